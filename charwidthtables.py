@@ -0,0 +1,98 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: BSL-1.0
+
+# Converts the range based character width tables in charclassification*.inc into direct indexed two stage lookup
+# tables for termpaint_char_width.h.
+#
+# usage: charwidthtables.py outfile infile...
+
+import re
+import sys
+
+CODEPOINTS = 0x110000
+BLOCK_SIZE = 256
+SECTION_SIZE = 0x4000
+
+
+def load(path):
+    with open(path, 'r') as f:
+        src = f.read()
+
+    offsets_match = re.search(r'termpaint_char_width_offsets_(\w+)\[[^\]]*\] = \{(.*?)\};', src, re.S)
+    data_match = re.search(r'termpaint_char_width_data_(\w+)\[\] = \{(.*?)\};', src, re.S)
+    if not offsets_match or not data_match or offsets_match.group(1) != data_match.group(1):
+        raise Exception('{}: can not find width tables'.format(path))
+
+    name = offsets_match.group(1)
+    offsets = [int(x) for x in re.findall(r'\d+', offsets_match.group(2))]
+    data = [(int(start, 16), int(width))
+            for start, width in re.findall(r'NEW_WIDTH\((0x[0-9a-fA-F]+), (-?\d+)\)', data_match.group(2))]
+
+    widths = []
+    for section in range(len(offsets) - 1):
+        entries = data[offsets[section]:offsets[section + 1]]
+        if not entries or entries[0][0] != 0:
+            raise Exception('{}: section {} does not start with data for 0'.format(path, section))
+        for i, (start, width) in enumerate(entries):
+            end = entries[i + 1][0] if i + 1 < len(entries) else SECTION_SIZE
+            widths += [width] * (end - start)
+
+    if len(widths) != CODEPOINTS:
+        raise Exception('{}: unexpected number of codepoints {}'.format(path, len(widths)))
+
+    return name, widths
+
+
+def format_array(decl, values, per_line):
+    lines = ['{} = {{'.format(decl)]
+    for i in range(0, len(values), per_line):
+        lines.append('    ' + ' '.join('{},'.format(v) for v in values[i:i + per_line]))
+    lines.append('};')
+    return '\n'.join(lines) + '\n'
+
+
+def generate(name, widths):
+    latin1 = widths[0:256]
+
+    blocks = {}
+    stage1 = []
+    stage2 = []
+    for block_start in range(0, CODEPOINTS, BLOCK_SIZE):
+        block = tuple(widths[block_start:block_start + BLOCK_SIZE])
+        if block not in blocks:
+            blocks[block] = len(blocks)
+            # 2 bits per codepoint, -1 is stored as 3
+            for i in range(0, BLOCK_SIZE, 4):
+                packed = 0
+                for j in range(4):
+                    packed |= (block[i + j] & 3) << (j * 2)
+                stage2.append(packed)
+        stage1.append(blocks[block])
+
+    if len(blocks) > 256:
+        raise Exception('{}: too many distinct blocks for 8 bit stage 1 table'.format(name))
+
+    out = ''
+    out += format_array('static const int8_t termpaint_char_width_latin1_{}[256]'.format(name), latin1, 32)
+    out += '\n'
+    out += format_array('static const uint8_t termpaint_char_width_stage1_{}[{}]'.format(name, len(stage1)),
+                        stage1, 32)
+    out += '\n'
+    out += format_array('static const uint8_t termpaint_char_width_stage2_{}[{}]'.format(name, len(stage2)),
+                        stage2, 16)
+    out += '\n'
+    return out
+
+
+def main():
+    outfile = sys.argv[1]
+    out = '// generated by charwidthtables.py, do not edit\n\n'
+    for infile in sys.argv[2:]:
+        name, widths = load(infile)
+        out += generate(name, widths)
+
+    with open(outfile, 'w') as f:
+        f.write(out)
+
+
+main()
@@ -0,0 +1,187 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: BSL-1.0
+
+# Generates a hash index for key_mapping_table in termpaint_input.c, so input sequences can be looked up without
+# scanning the whole table. Also rejects duplicate sequences at build time.
+#
+# usage: keymappingtable.py outfile termpaint_input.c
+
+import re
+import sys
+
+TOKEN_RE = re.compile(r'''
+    (?P<ws>\s+)
+  | (?P<comment>//[^\n]*|/\*.*?\*/)
+  | (?P<string>"(?:[^"\\\n]|\\.)*")
+  | (?P<char>'(?:[^'\\\n]|\\.)*')
+  | (?P<ident>[A-Za-z_][A-Za-z_0-9]*)
+  | (?P<number>[0-9][A-Za-z_0-9]*)
+  | (?P<punct>.)
+''', re.S | re.X)
+
+
+def tokenize(src):
+    tokens = []
+    for m in TOKEN_RE.finditer(src):
+        kind = m.lastgroup
+        if kind in ('ws', 'comment'):
+            continue
+        tokens.append((kind, m.group()))
+    return tokens
+
+
+def decode_string(literal):
+    body = literal[1:-1]
+    out = bytearray()
+    i = 0
+    while i < len(body):
+        ch = body[i]
+        if ch != '\\':
+            out += ch.encode('utf-8')
+            i += 1
+            continue
+        i += 1
+        ch = body[i]
+        if ch == 'x':
+            m = re.match(r'[0-9a-fA-F]+', body[i + 1:])
+            out.append(int(m.group(), 16))
+            i += 1 + len(m.group())
+        elif ch in '01234567':
+            m = re.match(r'[0-7]{1,3}', body[i:])
+            out.append(int(m.group(), 8))
+            i += len(m.group())
+        else:
+            simple = {'n': 10, 'r': 13, 't': 9, 'a': 7, 'b': 8, 'f': 12, 'v': 11, 'e': 27,
+                      '\\': 92, '"': 34, "'": 39, '?': 63}
+            out.append(simple[ch])
+            i += 1
+    return bytes(out)
+
+
+def parse_macros(src):
+    macros = {}
+    for m in re.finditer(r'^#define\s+(\w+)\(([^)]*)\)((?:[^\n]*\\\n)*[^\n]*)', src, re.M):
+        params = [p.strip() for p in m.group(2).split(',')]
+        body = m.group(3).replace('\\\n', '\n')
+        macros[m.group(1)] = (params, tokenize(body))
+    return macros
+
+
+def split_args(tokens, start):
+    # tokens[start] is the opening parenthesis, returns (args, index after closing parenthesis)
+    args = [[]]
+    depth = 0
+    i = start
+    while True:
+        kind, text = tokens[i]
+        if text in '({[' and kind == 'punct':
+            depth += 1
+            if depth > 1:
+                args[-1].append(tokens[i])
+        elif text in ')}]' and kind == 'punct':
+            depth -= 1
+            if depth == 0:
+                return args, i + 1
+            args[-1].append(tokens[i])
+        elif text == ',' and kind == 'punct' and depth == 1:
+            args.append([])
+        else:
+            args[-1].append(tokens[i])
+        i += 1
+
+
+def expand(tokens, macros):
+    out = []
+    i = 0
+    while i < len(tokens):
+        kind, text = tokens[i]
+        if kind == 'ident' and text in macros and i + 1 < len(tokens) and tokens[i + 1][1] == '(':
+            params, body = macros[text]
+            args, i = split_args(tokens, i + 1)
+            if len(args) != len(params):
+                raise Exception('wrong number of arguments for {}'.format(text))
+            subst = dict(zip(params, args))
+            replaced = []
+            for tok in body:
+                if tok[0] == 'ident' and tok[1] in subst:
+                    replaced += subst[tok[1]]
+                else:
+                    replaced.append(tok)
+            out += expand(replaced, macros)
+        else:
+            out.append(tokens[i])
+            i += 1
+    return out
+
+
+def load_sequences(path):
+    with open(path, 'r') as f:
+        src = f.read()
+
+    m = re.search(r'key_mapping_entry key_mapping_table\[\] = \{(.*?)\n\};', src, re.S)
+    if not m:
+        raise Exception('{}: can not find key_mapping_table'.format(path))
+
+    tokens = expand(tokenize(m.group(1)), parse_macros(src))
+
+    sequences = []
+    i = 0
+    while i < len(tokens):
+        if tokens[i][1] != '{':
+            raise Exception('unexpected token {} in key_mapping_table'.format(tokens[i][1]))
+        fields, i = split_args(tokens, i)
+        if i < len(tokens) and tokens[i][1] == ',':
+            i += 1
+        if fields[0][0][0] != 'string':
+            # terminating entry
+            break
+        sequences.append(b''.join(decode_string(tok[1]) for tok in fields[0]))
+    return sequences
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def main():
+    outfile = sys.argv[1]
+    sequences = load_sequences(sys.argv[2])
+
+    seen = {}
+    for idx, seq in enumerate(sequences):
+        if seq in seen:
+            raise Exception('Duplicate key mapping: {!r} (entries {} and {})'.format(seq, seen[seq], idx))
+        seen[seq] = idx
+        if len(seq) > 255:
+            raise Exception('Key mapping too long: {!r}'.format(seq))
+
+    size = 1
+    while size < 2 * len(sequences):
+        size *= 2
+    if len(sequences) >= 0xffff:
+        raise Exception('too many key mappings')
+
+    slots = [None] * size
+    for idx, seq in enumerate(sequences):
+        slot = fnv1a(seq) & (size - 1)
+        while slots[slot] is not None:
+            slot = (slot + 1) & (size - 1)
+        slots[slot] = (idx, len(seq))
+
+    out = '// generated by keymappingtable.py from termpaint_input.c, do not edit\n\n'
+    out += '#define KEY_MAPPING_TABLE_ENTRIES {}\n'.format(len(sequences))
+    out += '#define KEY_MAPPING_INDEX_MASK {}\n\n'.format(size - 1)
+    out += 'static const key_mapping_index_slot key_mapping_index[{}] = {{\n'.format(size)
+    for i in range(0, size, 8):
+        out += '   ' + ''.join(' {{ {}, {} }},'.format(*(s if s else ('KEY_MAPPING_INDEX_EMPTY', 0)))
+                               for s in slots[i:i + 8]) + '\n'
+    out += '};\n'
+
+    with open(outfile, 'w') as f:
+        f.write(out)
+
+
+main()
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: BSL-1.0
 #include "termpaint.h"
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -57,9 +58,14 @@ typedef unsigned char uchar;
  * The unicode codepoints for an cluster are either represented as a up to 8 byte utf8
  * sequence inline in the cell structure or by an reference to an separate overflow node
  * in case they do not fit within that space. These overflow nodes are managed with an
- * auxilary (per surface) hash table. Unused entries are expired when the hash table would
+ * auxilary hash table that is shared by all surfaces of a terminal. Thus the node pointers are
+ * stable ids that can be copied between these surfaces. Each node counts the cells (in rows and cells_last_flush)
+ * that reference it. Entries with a zero reference count are expired when the hash table would
  * have to grow otherwise.
  *
+ * The cells of a surface are stored in separately allocated rows. A duplicated surface shares all rows with
+ * its source (reference counted) until one of them is about to modify a row, which then gets copied first.
+ *
  * Attributes consist of the following:
  * - bold (yes/no)
  * - italic (yes/no)
@@ -108,7 +114,7 @@ struct termpaint_attr_ {
 
 #define CELL_ATTR_DECO_MASK CELL_ATTR_UNDERLINE_MASK
 
-#define CELL_SOFTWRAP_MARKER (1 << 15)
+#define CELL_SOFTWRAP_MARKER (1 << 8)
 #define CELL_ATTR_MASK ((uint16_t)(~CELL_SOFTWRAP_MARKER))
 
 #define TERMPAINT_STYLE_PASSTHROUGH (TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_ITALIC | TERMPAINT_STYLE_BLINK \
@@ -120,11 +126,11 @@ typedef struct cell_ {
     uint32_t fg_color;
     uint32_t bg_color;
     uint32_t deco_color;
-    uint16_t flags; // bold, italic, underline[2], blinking, overline, inverse, strikethrough. softwrap marker
-    uint8_t attr_patch_idx;
+    uint32_t flags : 9; // bold, italic, underline[2], blinking, overline, inverse, strikethrough. softwrap marker
+    uint32_t attr_patch_idx : 15;
 
-    uint8_t cluster_expansion : 4;
-    uint8_t text_len : 4; // == 0 -> text_overflow is active or WIDE_RIGHT_PADDING.
+    uint32_t cluster_expansion : 4;
+    uint32_t text_len : 4; // == 0 -> text_overflow is active or WIDE_RIGHT_PADDING.
     union {
         termpaint_hash_item* text_overflow;
         unsigned char text[8];
@@ -133,6 +139,16 @@ typedef struct cell_ {
 
 _Static_assert(sizeof(void*) > 8 || sizeof(cell) == 24, "bad cell size");
 
+typedef struct termpaintp_overflow_text_ {
+    termpaint_hash_item base;
+    // number of cells (in rows and cells_last_flush of all surfaces) that reference this node, rows shared by
+    // multiple surfaces count once
+    unsigned refcount;
+} termpaintp_overflow_text;
+
+// limited by the size of attr_patch_idx in cell
+#define TERMPAINTP_PATCHES_MAX ((1 << 15) - 1)
+
 typedef struct termpaintp_patch_ {
     bool optimize;
 
@@ -142,21 +158,55 @@ typedef struct termpaintp_patch_ {
     uint32_t cleanup_hash;
     unsigned char *cleanup;
 
-    bool unused;
+    // number of cells (in rows and cells_last_flush) of this surface that use this patch
+    unsigned refcount;
+    // index + 1 of the next patch in the same bucket of patch_buckets or in the free list; 0 terminates
+    uint16_t next;
 } termpaintp_patch;
 
+// Storage for one row of a surface. Rows are shared between a surface and its duplicates until one of them
+// modifies the row, see termpaintp_surface_prepare_modify_rows.
+typedef struct termpaintp_row_ {
+    // number of surfaces using this row
+    unsigned refcount;
+    cell cells[];
+} termpaintp_row;
+
+// Overflow text storage of a worker surface, shared with duplicates of that surface.
+typedef struct termpaintp_private_overflow_text_ {
+    termpaint_hash hash;
+    // number of surfaces using this storage
+    unsigned refcount;
+} termpaintp_private_overflow_text;
+
 struct termpaint_surface_ {
     termpaint_terminal *terminal;
 
+    // Storage for interned overflow text. Points to the storage of the terminal, except for worker surfaces which
+    // have private storage so they can be used concurrently with other surfaces.
+    termpaint_hash *overflow_text;
+    termpaintp_private_overflow_text *private_overflow_text;
+
     bool primary;
-    cell* cells;
+    termpaintp_row **rows;
     cell* cells_last_flush;
     unsigned cells_allocated;
     int width;
     int height;
 
-    termpaint_hash overflow_text;
+    // Patches are indexed by attr_patch_idx - 1. Unused slots (setup == nullptr) are linked from patch_free.
+    // Slots with a refcount of zero are only reclaimed when all slots are in use.
     termpaintp_patch *patches;
+    int patches_allocated;
+    int patches_used;
+    uint16_t patch_free;
+    uint16_t *patch_buckets; // power of two sized, heads of lists linked via termpaintp_patch.next
+    unsigned patch_bucket_mask;
+
+    // Per row content hashes, only allocated once termpaint_surface_row_hash was used. Rows are invalidated on
+    // modification and rehashed lazily.
+    uint32_t *row_hashes;
+    bool *row_hash_valid;
 };
 
 typedef enum auto_detect_state_ {
@@ -200,9 +250,84 @@ typedef enum auto_detect_state_ {
     AD_GLITCH_PATCHING,
     // hacks
     AD_HTERM_RECOVERY1,
-    AD_HTERM_RECOVERY2
+    AD_HTERM_RECOVERY2,
+    // after auto detection, see termpaint_terminal_calibrate_char_widths
+    AD_WIDTH_CALIBRATION
 } auto_detect_state;
 
+typedef struct termpaintp_codepoint_range_ {
+    int first;
+    int last;
+} termpaintp_codepoint_range;
+
+// Ranges of codepoints where terminals commonly disagree about the width. All codepoints in a group are assumed to
+// be rendered with the same width as the probe codepoint.
+typedef struct termpaintp_width_probe_ {
+    int probe;
+    int range_count;
+    const termpaintp_codepoint_range *ranges;
+} termpaintp_width_probe;
+
+static const termpaintp_codepoint_range termpaintp_width_probe_greek_cyrillic[] = {
+    { 0x391, 0x3a1 }, { 0x3a3, 0x3a9 }, { 0x3b1, 0x3c1 }, { 0x3c3, 0x3c9 },
+    { 0x401, 0x401 }, { 0x410, 0x44f }, { 0x451, 0x451 }
+};
+
+static const termpaintp_codepoint_range termpaintp_width_probe_enclosed_alnum[] = {
+    { 0x2460, 0x24e9 }, { 0x24eb, 0x24ff }
+};
+
+static const termpaintp_codepoint_range termpaintp_width_probe_box_drawing[] = {
+    { 0x2500, 0x254b }, { 0x2550, 0x2573 }, { 0x2580, 0x258f }, { 0x2592, 0x2595 }
+};
+
+// Unicode 9 changed these to emoji presentation and thus wide.
+static const termpaintp_codepoint_range termpaintp_width_probe_bmp_emoji[] = {
+    { 0x231a, 0x231b }, { 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe },
+    { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+    { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 },
+    { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd },
+    { 0x2705, 0x2705 }, { 0x270a, 0x270b }, { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+    { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+    { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }
+};
+
+static const termpaintp_codepoint_range termpaintp_width_probe_regional_indicators[] = {
+    { 0x1f1e6, 0x1f1ff }
+};
+
+static const termpaintp_codepoint_range termpaintp_width_probe_supplemental_symbols[] = {
+    { 0x1f90c, 0x1f93a }, { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }
+};
+
+static const termpaintp_codepoint_range termpaintp_width_probe_symbols_ext_a[] = {
+    { 0x1fa70, 0x1faff }
+};
+
+#define WIDTH_PROBE(cp, ranges) { cp, sizeof(ranges) / sizeof(ranges[0]), ranges }
+
+static const termpaintp_width_probe termpaintp_width_probes[] = {
+    WIDTH_PROBE(0x3b1, termpaintp_width_probe_greek_cyrillic),
+    WIDTH_PROBE(0x2460, termpaintp_width_probe_enclosed_alnum),
+    WIDTH_PROBE(0x2500, termpaintp_width_probe_box_drawing),
+    WIDTH_PROBE(0x231a, termpaintp_width_probe_bmp_emoji),
+    WIDTH_PROBE(0x1f1e6, termpaintp_width_probe_regional_indicators),
+    WIDTH_PROBE(0x1f914, termpaintp_width_probe_supplemental_symbols),
+    WIDTH_PROBE(0x1fa90, termpaintp_width_probe_symbols_ext_a),
+};
+
+#undef WIDTH_PROBE
+
+#define NUM_WIDTH_PROBES ((int)(sizeof(termpaintp_width_probes) / sizeof(termpaintp_width_probes[0])))
+
+// Width table created by termpaint_terminal_calibrate_char_widths. These are kept until the terminal is freed, so
+// pointers to the table stay unique for caches keyed by the width table.
+typedef struct termpaintp_calibrated_width_ {
+    struct termpaintp_calibrated_width_ *next;
+    termpaintp_width table;
+    termpaintp_width_override overrides[];
+} termpaintp_calibrated_width;
+
 typedef enum terminal_type_enum_ {
     TT_INCOMPATIBLE,  // does not respond to ESC 5n, or similar deal breakers
     TT_TOODUMB,
@@ -238,6 +363,29 @@ typedef struct termpaint_str_ {
     unsigned char *data;
 } termpaint_str;
 
+typedef struct termpaintp_queued_event_ {
+    termpaint_event event;
+    // offset of the event's string in the arena of the queue, if the event has a string
+    unsigned payload_offset;
+} termpaintp_queued_event;
+
+typedef struct termpaintp_event_queue_ {
+    int capacity; // 0 if events are delivered via event_cb
+    int head;
+    int count;
+    // set while the last slot is used by an overflow event, further events are dropped
+    bool overflow;
+    termpaintp_queued_event *events;
+    // strings of queued events in queue order, reset when the queue is empty
+    termpaint_str arena;
+    // strings before this offset belong to events that were already returned, they are reclaimed on the next push
+    // that would otherwise need to grow the arena.
+    unsigned arena_start;
+    // the event last returned by termpaint_terminal_next_event and a copy of its string
+    termpaint_event current;
+    termpaint_str current_payload;
+} termpaintp_event_queue;
+
 typedef struct termpaint_color_entry_ {
     termpaint_hash_item base;
     termpaint_str restore;
@@ -290,6 +438,7 @@ typedef struct termpaint_terminal_ {
     termpaint_str terminal_self_reported_name_version;
     void (*event_cb)(void *, termpaint_event *);
     void *event_user_data;
+    termpaintp_event_queue event_queue;
     bool (*raw_input_filter_cb)(void *user_data, const char *data, unsigned length, bool overflow);
     void *raw_input_filter_user_data;
 
@@ -315,6 +464,9 @@ typedef struct termpaint_terminal_ {
     termpaint_str unpause_basic_setup;
     termpaint_hash unpause_snippets;
 
+    // text of clusters that do not fit into a cell, shared by all surfaces of this terminal
+    termpaint_hash overflow_text;
+
     bool glitch_on_oom;
     unsigned log_mask;
 
@@ -331,7 +483,12 @@ typedef struct termpaint_terminal_ {
     int glitch_cursor_y;
     bool seen_dec_terminal_param;
     auto_detect_state glitch_patching_next_state;
+    // state restored when width calibration is done
+    auto_detect_state width_calibration_prev_state;
+    int width_calibration_received;
+    int width_calibration_results[NUM_WIDTH_PROBES];
     // </>
+    termpaintp_calibrated_width *calibrated_widths;
     bool capabilities[NUM_CAPABILITIES];
     int max_csi_parameters;
 } termpaint_terminal;
@@ -347,6 +504,61 @@ typedef enum termpaint_text_measurement_decoder_state_ {
     TMD_PARTIAL_UTF8
 } termpaint_text_measurement_decoder_state;
 
+typedef struct termpaintp_prepared_cluster_ {
+    int text_offset;
+    uint8_t text_len;
+    uint8_t width;
+} termpaintp_prepared_cluster;
+
+struct termpaint_prepared_text_ {
+    // width table the clusters were computed with
+    const termpaintp_width *char_width_table;
+
+    int width;
+    int cluster_count;
+    termpaintp_prepared_cluster *clusters;
+    // cluster texts, each terminated by a nul byte
+    unsigned char *text;
+
+    // original input, used to recompute the clusters when the width table of the terminal changed
+    unsigned char *input;
+    int input_len;
+};
+
+// Position after a cluster, the cluster count is implied by the index of the boundary.
+typedef struct termpaintp_measurement_boundary_ {
+    int codepoints;
+    int width;
+    int ref;
+} termpaintp_measurement_boundary;
+
+typedef struct termpaintp_measurement_cache_entry_ {
+    struct termpaintp_measurement_cache_entry_ *bucket_next;
+    // most recently used first
+    struct termpaintp_measurement_cache_entry_ *lru_prev;
+    struct termpaintp_measurement_cache_entry_ *lru_next;
+
+    uint32_t hash;
+    const termpaintp_width *char_width_table;
+    int final_state; // termpaint_text_measurement_state after measuring the whole string
+    int cluster_count;
+    termpaintp_measurement_boundary *boundaries;
+    int len;
+    unsigned char string[];
+} termpaintp_measurement_cache_entry;
+
+typedef struct termpaintp_measurement_cache_ {
+    int max_entries;
+    int count;
+    uint32_t bucket_mask;
+    termpaintp_measurement_cache_entry **buckets;
+    termpaintp_measurement_cache_entry *lru_first;
+    termpaintp_measurement_cache_entry *lru_last;
+
+    unsigned long hits;
+    unsigned long misses;
+} termpaintp_measurement_cache;
+
 struct termpaint_text_measurement_ {
     termpaint_terminal *terminal;
 
@@ -371,6 +583,8 @@ struct termpaint_text_measurement_ {
     uint8_t utf8_size;
     uint8_t utf8_available;
     uint8_t utf8_units[6];
+
+    termpaintp_measurement_cache *cache;
 };
 
 static size_t ustrlen (const uchar *s) {
@@ -675,13 +889,26 @@ static void termpaintp_collapse(termpaint_surface *surface) {
     surface->width = 0;
     surface->height = 0;
     surface->cells_allocated = 0;
-    surface->cells = nullptr;
+    surface->rows = nullptr;
     surface->cells_last_flush = nullptr;
 }
 
+static void termpaintp_surface_release_cells(termpaint_surface *surface);
+
+static void termpaintp_surface_discard_row_hashes(termpaint_surface *surface) {
+    free(surface->row_hashes);
+    surface->row_hashes = nullptr;
+    free(surface->row_hash_valid);
+    surface->row_hash_valid = nullptr;
+}
+
 static bool termpaintp_resize_mustcheck(termpaint_surface *surface, int width, int height) {
     // TODO move contents along?
 
+    // all branches below discard the current cells
+    termpaintp_surface_release_cells(surface);
+    termpaintp_surface_discard_row_hashes(surface);
+
     surface->width = width;
     surface->height = height;
     _Static_assert(sizeof(int) <= sizeof(size_t), "int smaller than size_t");
@@ -693,26 +920,34 @@ static bool termpaintp_resize_mustcheck(termpaint_surface *surface, int width, i
      || termpaint_smul_overflow(cell_count, sizeof(cell), &bytes)) {
         // collapse and bail
         int_debuglog_printf(surface->terminal, "surface resize: Invalid size %dx%d, collapsing surface.", width, height);
-        free(surface->cells);
-        free(surface->cells_last_flush);
         termpaintp_collapse(surface);
         return true; // This is debatable, but the previous code did allow this and there are tests for this.
     }
     surface->cells_allocated = cell_count;
-    free(surface->cells);
-    free(surface->cells_last_flush);
-    surface->cells_last_flush = nullptr;
-    surface->cells = calloc(1, bytes);
-    if (!surface->cells) {
+    surface->rows = calloc(height ? height : 1, sizeof(termpaintp_row*));
+    if (!surface->rows) {
         termpaintp_collapse(surface);
         return false;
     }
+    for (int y = 0; y < height; y++) {
+        termpaintp_row *row = calloc(1, sizeof(termpaintp_row) + width * sizeof(cell));
+        if (!row) {
+            for (int i = 0; i < y; i++) {
+                free(surface->rows[i]);
+            }
+            free(surface->rows);
+            termpaintp_collapse(surface);
+            return false;
+        }
+        row->refcount = 1;
+        surface->rows[y] = row;
+    }
 
     if (surface->primary) {
         surface->terminal->force_full_repaint = true;
         surface->cells_last_flush = calloc(1, surface->cells_allocated * sizeof(cell));
         if (!surface->cells_last_flush) {
-            free(surface->cells);
+            termpaintp_surface_release_cells(surface);
             termpaintp_collapse(surface);
             return false;
         }
@@ -725,18 +960,22 @@ static inline cell* termpaintp_getcell(const termpaint_surface *surface, int x,
     if (x >= 0 && y >= 0
         && x < surface->width && y < surface->height
         && index < surface->cells_allocated) {
-        return &surface->cells[index];
+        return &surface->rows[y]->cells[x];
     } else {
         BUG("cell out of range");
     }
 }
 
+static inline bool termpaintp_cell_is_wide_right_padding(const cell *c) {
+    return c->text_len == 0 && c->text_overflow == WIDE_RIGHT_PADDING;
+}
+
 static inline cell* termpaintp_getcell_or_null(const termpaint_surface *surface, int x, int y) {
     unsigned index = y*surface->width + x;
     if (x >= 0 && y >= 0
         && x < surface->width && y < surface->height) {
         if (index < surface->cells_allocated) {
-            return &surface->cells[index];
+            return &surface->rows[y]->cells[x];
         } else {
             BUG("cell out of range");
         }
@@ -745,10 +984,112 @@ static inline cell* termpaintp_getcell_or_null(const termpaint_surface *surface,
     }
 }
 
+static inline void termpaintp_cell_text_retain(const cell *c) {
+    if (c->text_len == 0 && c->text_overflow != nullptr && c->text_overflow != WIDE_RIGHT_PADDING) {
+        container_of(c->text_overflow, termpaintp_overflow_text, base)->refcount++;
+    }
+}
+
+// Must be called before the text of a cell is overwritten
+static inline void termpaintp_cell_text_release(const cell *c) {
+    if (c->text_len == 0 && c->text_overflow != nullptr && c->text_overflow != WIDE_RIGHT_PADDING) {
+        container_of(c->text_overflow, termpaintp_overflow_text, base)->refcount--;
+    }
+}
+
+static inline void termpaintp_surface_patch_retain(termpaint_surface *surface, uint16_t idx) {
+    if (idx) {
+        surface->patches[idx - 1].refcount++;
+    }
+}
+
+static inline void termpaintp_surface_patch_release(termpaint_surface *surface, uint16_t idx) {
+    if (idx) {
+        surface->patches[idx - 1].refcount--;
+    }
+}
+
+static inline void termpaintp_cell_patch_retain(termpaint_surface *surface, const cell *c) {
+    termpaintp_surface_patch_retain(surface, c->attr_patch_idx);
+}
+
+static inline void termpaintp_cell_patch_release(termpaint_surface *surface, const cell *c) {
+    termpaintp_surface_patch_release(surface, c->attr_patch_idx);
+}
+
+static void termpaintp_surface_release_cells(termpaint_surface *surface) {
+    // Used when all cells of a surface are discarded at once. Also frees the storage of the cells.
+    if (surface->rows) {
+        for (int y = 0; y < surface->height; y++) {
+            termpaintp_row *row = surface->rows[y];
+            // text references are counted once per row, patch references once per surface
+            bool last_ref = row->refcount == 1;
+            for (int x = 0; x < surface->width; x++) {
+                if (last_ref) {
+                    termpaintp_cell_text_release(&row->cells[x]);
+                }
+                termpaintp_cell_patch_release(surface, &row->cells[x]);
+            }
+            if (last_ref) {
+                free(row);
+            } else {
+                row->refcount--;
+            }
+        }
+        free(surface->rows);
+        surface->rows = nullptr;
+    }
+    if (surface->cells_last_flush) {
+        for (unsigned i = 0; i < surface->cells_allocated; i++) {
+            termpaintp_cell_text_release(&surface->cells_last_flush[i]);
+            termpaintp_cell_patch_release(surface, &surface->cells_last_flush[i]);
+        }
+        free(surface->cells_last_flush);
+        surface->cells_last_flush = nullptr;
+    }
+}
+
+static void termpaintp_surface_unshare_row(termpaint_surface *surface, int y) {
+    termpaintp_row *shared = surface->rows[y];
+    termpaintp_row *row = malloc(sizeof(termpaintp_row) + surface->width * sizeof(cell));
+    if (!row) {
+        termpaintp_oom(surface->terminal);
+    }
+    row->refcount = 1;
+    memcpy(row->cells, shared->cells, surface->width * sizeof(cell));
+    for (int x = 0; x < surface->width; x++) {
+        termpaintp_cell_text_retain(&row->cells[x]);
+    }
+    shared->refcount--;
+    surface->rows[y] = row;
+}
+
+// Must be called by every function that modifies cells before modifying cells in rows [y, y + height). Invalidates
+// the cached row hashes and copies rows that are still shared with other surfaces.
+static inline void termpaintp_surface_prepare_modify_rows(termpaint_surface *surface, int y, int height) {
+    if (y < 0) {
+        height += y;
+        y = 0;
+    }
+    if (y + height > surface->height) {
+        height = surface->height - y;
+    }
+    if (height <= 0) {
+        return;
+    }
+    if (surface->row_hash_valid) {
+        memset(surface->row_hash_valid + y, 0, height * sizeof(bool));
+    }
+    for (int y1 = y; y1 < y + height; y1++) {
+        if (surface->rows[y1]->refcount > 1) {
+            termpaintp_surface_unshare_row(surface, y1);
+        }
+    }
+}
+
 static void termpaintp_set_overflow_text(termpaint_surface *surface, cell *dst_cell, const unsigned char* data) {
-    // hash_ensure needs to be done before touching text_len, because it can cause garbage collection which would
-    // see an inconistant state if text_len is already set to zero.
-    void* overflow_ptr = termpaintp_hash_ensure(&surface->overflow_text, data);
+    // precondition: the previous text of dst_cell is already released.
+    void* overflow_ptr = termpaintp_hash_ensure(surface->overflow_text, data);
     if (!overflow_ptr) {
         if (!surface->terminal->glitch_on_oom) {
             termpaintp_oom(surface->terminal);
@@ -756,126 +1097,207 @@ static void termpaintp_set_overflow_text(termpaint_surface *surface, cell *dst_c
             termpaintp_oom_log_only(surface->terminal);
             dst_cell->text_len = 1;
             dst_cell->text[0] = '?';
+            return;
         }
     }
     dst_cell->text_len = 0;
     dst_cell->text_overflow = overflow_ptr;
+    termpaintp_cell_text_retain(dst_cell);
+}
+
+static void termpaintp_copy_overflow_text(termpaint_surface *src_surface, const cell *src_cell,
+                                          termpaint_surface *dst_surface, cell *dst_cell) {
+    // precondition: the previous text of dst_cell is already released.
+    if (src_surface->overflow_text == dst_surface->overflow_text) {
+        // same storage, just take another reference
+        dst_cell->text_len = 0;
+        dst_cell->text_overflow = src_cell->text_overflow;
+        termpaintp_cell_text_retain(dst_cell);
+    } else {
+        termpaintp_set_overflow_text(dst_surface, dst_cell, src_cell->text_overflow->text);
+    }
 }
 
 static void termpaintp_surface_destroy(termpaint_surface *surface) {
-    free(surface->cells);
-    free(surface->cells_last_flush);
-    termpaintp_hash_destroy(&surface->overflow_text);
+    termpaintp_surface_release_cells(surface);
 
     if (surface->patches) {
-        for (int i = 0; i < 255; ++i) {
+        for (int i = 0; i < surface->patches_allocated; ++i) {
             free(surface->patches[i].setup);
             free(surface->patches[i].cleanup);
         }
         free(surface->patches);
         surface->patches = nullptr;
+        surface->patches_allocated = 0;
+        surface->patches_used = 0;
+        surface->patch_free = 0;
     }
+    free(surface->patch_buckets);
+    surface->patch_buckets = nullptr;
+    termpaintp_surface_discard_row_hashes(surface);
     termpaintp_collapse(surface);
+
+    if (surface->private_overflow_text) {
+        if (--surface->private_overflow_text->refcount == 0) {
+            termpaintp_hash_destroy(&surface->private_overflow_text->hash);
+            free(surface->private_overflow_text);
+        }
+        surface->private_overflow_text = nullptr;
+    }
 }
 
-static uint8_t termpaintp_surface_ensure_patch_idx(termpaint_surface *surface, bool optimize, unsigned char *setup,
-                                                unsigned char *cleanup) {
-    if (!setup || !cleanup) {
-        return 0;
+static inline uint32_t termpaintp_patch_bucket_hash(uint32_t setup_hash, uint32_t cleanup_hash) {
+    return setup_hash ^ (cleanup_hash * 31);
+}
+
+// Rebuilds bucket lists and free list. Also reclaims slots with zero references if `reclaim` is set.
+static int termpaintp_surface_rebuild_patch_index(termpaint_surface *surface, bool reclaim) {
+    int reclaimed = 0;
+
+    for (unsigned i = 0; i <= surface->patch_bucket_mask; i++) {
+        surface->patch_buckets[i] = 0;
     }
+    surface->patch_free = 0;
 
-    if (!surface->patches) {
-        surface->patches = calloc(255, sizeof(termpaintp_patch));
-        if (!surface->patches) {
-            if (!surface->terminal->glitch_on_oom) {
-                termpaintp_oom(surface->terminal);
-            } else {
-                termpaintp_oom_log_only(surface->terminal);
-                return 0;
-            }
+    // build free list in reverse, so low indices are reused first
+    for (int i = surface->patches_allocated - 1; i >= 0; --i) {
+        termpaintp_patch *patch = &surface->patches[i];
+        if (patch->setup && reclaim && patch->refcount == 0) {
+            free(patch->setup);
+            free(patch->cleanup);
+            patch->setup = nullptr;
+            patch->cleanup = nullptr;
+            --surface->patches_used;
+            ++reclaimed;
+        }
+        if (patch->setup) {
+            uint32_t bucket = termpaintp_patch_bucket_hash(patch->setup_hash, patch->cleanup_hash)
+                    & surface->patch_bucket_mask;
+            patch->next = surface->patch_buckets[bucket];
+            surface->patch_buckets[bucket] = i + 1;
+        } else {
+            patch->next = surface->patch_free;
+            surface->patch_free = i + 1;
         }
     }
+    return reclaimed;
+}
+
+static bool termpaintp_surface_grow_patches(termpaint_surface *surface) {
+    if (surface->patches_allocated >= TERMPAINTP_PATCHES_MAX) {
+        return false;
+    }
+    int new_allocated = surface->patches_allocated ? surface->patches_allocated * 2 : 16;
+    if (new_allocated > TERMPAINTP_PATCHES_MAX) {
+        new_allocated = TERMPAINTP_PATCHES_MAX;
+    }
+    unsigned new_bucket_count = 16;
+    while (new_bucket_count < (unsigned)new_allocated) {
+        new_bucket_count *= 2;
+    }
+
+    int old_allocated = surface->patches_allocated;
+    termpaintp_patch *new_patches = realloc(surface->patches, new_allocated * sizeof(termpaintp_patch));
+    if (!new_patches) {
+        return false;
+    }
+    surface->patches = new_patches;
+    memset(surface->patches + surface->patches_allocated, 0,
+           (new_allocated - surface->patches_allocated) * sizeof(termpaintp_patch));
+    surface->patches_allocated = new_allocated;
+
+    uint16_t *new_buckets = calloc(new_bucket_count, sizeof(uint16_t));
+    if (!new_buckets) {
+        // keep old index, the additional slots are just not used yet.
+        surface->patches_allocated = old_allocated;
+        return false;
+    }
+    free(surface->patch_buckets);
+    surface->patch_buckets = new_buckets;
+    surface->patch_bucket_mask = new_bucket_count - 1;
+    termpaintp_surface_rebuild_patch_index(surface, false);
+    return true;
+}
+
+static uint16_t termpaintp_surface_ensure_patch_idx(termpaint_surface *surface, bool optimize, unsigned char *setup,
+                                                    unsigned char *cleanup) {
+    if (!setup || !cleanup) {
+        return 0;
+    }
 
     uint32_t setup_hash = termpaintp_hash_fnv1a(setup);
     uint32_t cleanup_hash = termpaintp_hash_fnv1a(cleanup);
 
-    int free_slot = -1;
-
-    for (int i = 0; i < 255; ++i) {
-        if (!surface->patches[i].setup) {
-            if (free_slot == -1) {
-                free_slot = i;
+    if (surface->patch_buckets) {
+        uint32_t bucket = termpaintp_patch_bucket_hash(setup_hash, cleanup_hash) & surface->patch_bucket_mask;
+        for (uint16_t idx = surface->patch_buckets[bucket]; idx; idx = surface->patches[idx - 1].next) {
+            termpaintp_patch *patch = &surface->patches[idx - 1];
+            if (patch->setup_hash == setup_hash
+                    && patch->cleanup_hash == cleanup_hash
+                    && ustrcmp(setup, patch->setup) == 0
+                    && ustrcmp(cleanup, patch->cleanup) == 0) {
+                return idx;
             }
-            continue;
-        }
-
-        if (surface->patches[i].setup_hash == setup_hash
-                && surface->patches[i].cleanup_hash == cleanup_hash
-                && ustrcmp(setup, surface->patches[i].setup) == 0
-                && ustrcmp(cleanup, surface->patches[i].cleanup) == 0) {
-            return i + 1;
         }
     }
 
-    if (free_slot == -1) {
-        // try to free unused entries
-        for (int i = 0; i < 255; ++i) {
-            surface->patches[i].unused = true;
+    if (!surface->patch_free) {
+        // try to free unused entries first, but only use that if it frees a reasonable amount of slots.
+        int reclaimed = 0;
+        if (surface->patches_used) {
+            reclaimed = termpaintp_surface_rebuild_patch_index(surface, true);
         }
-
-        for (int y = 0; y < surface->height; y++) {
-            for (int x = 0; x < surface->width; x++) {
-                cell* c = termpaintp_getcell(surface, x, y);
-                if (c->attr_patch_idx) {
-                    surface->patches[c->attr_patch_idx - 1].unused = false;
-                }
-                if (surface->cells_last_flush) {
-                    cell* old_c = &surface->cells_last_flush[y*surface->width+x];
-                    if (old_c->attr_patch_idx) {
-                        surface->patches[old_c->attr_patch_idx - 1].unused = false;
+        if (reclaimed < surface->patches_allocated / 8 || !surface->patch_free) {
+            if (!termpaintp_surface_grow_patches(surface) && !surface->patch_free) {
+                if (surface->patches_allocated < TERMPAINTP_PATCHES_MAX) {
+                    if (!surface->terminal->glitch_on_oom) {
+                        termpaintp_oom(surface->terminal);
+                    } else {
+                        termpaintp_oom_log_only(surface->terminal);
                     }
                 }
+                // can't fit anymore, just ignore it.
+                return 0;
             }
         }
+    }
 
-        for (int i = 0; i < 255; ++i) {
-            if (surface->patches[i].unused) {
-                free(surface->patches[i].setup);
-                free(surface->patches[i].cleanup);
-                surface->patches[i].setup = nullptr;
-                surface->patches[i].cleanup = nullptr;
-
-                if (free_slot == -1) {
-                    free_slot = i;
-                }
-            }
+    unsigned char *setup_copy = ustrdup(setup);
+    unsigned char *cleanup_copy = ustrdup(cleanup);
+    if (!setup_copy || !cleanup_copy) {
+        if (!surface->terminal->glitch_on_oom) {
+            termpaintp_oom(surface->terminal);
+        } else {
+            free(setup_copy);
+            free(cleanup_copy);
+            termpaintp_oom_log_only(surface->terminal);
+            return 0;
         }
     }
 
-    if (free_slot != -1) {
-        unsigned char *setup_copy = ustrdup(setup);
-        unsigned char *cleanup_copy = ustrdup(cleanup);
-        if (!setup_copy || !cleanup_copy) {
-            if (!surface->terminal->glitch_on_oom) {
-                termpaintp_oom(surface->terminal);
-            } else {
-                free(setup_copy);
-                free(cleanup_copy);
-                termpaintp_oom_log_only(surface->terminal);
-                return 0;
-            }
-        }
-        surface->patches[free_slot].optimize = optimize;
-        surface->patches[free_slot].setup_hash = setup_hash;
-        surface->patches[free_slot].cleanup_hash = cleanup_hash;
-        surface->patches[free_slot].setup = setup_copy;
-        surface->patches[free_slot].cleanup = cleanup_copy;
+    uint16_t idx = surface->patch_free;
+    termpaintp_patch *patch = &surface->patches[idx - 1];
+    surface->patch_free = patch->next;
 
-        return free_slot + 1;
-    }
+    patch->optimize = optimize;
+    patch->setup_hash = setup_hash;
+    patch->cleanup_hash = cleanup_hash;
+    patch->setup = setup_copy;
+    patch->cleanup = cleanup_copy;
+    patch->refcount = 0;
+
+    uint32_t bucket = termpaintp_patch_bucket_hash(setup_hash, cleanup_hash) & surface->patch_bucket_mask;
+    patch->next = surface->patch_buckets[bucket];
+    surface->patch_buckets[bucket] = idx;
+    ++surface->patches_used;
 
-    // can't fit anymore, just ignore it.
-    return 0;
+    return idx;
+}
+
+static inline void termpaintp_cell_set_patch_idx(termpaint_surface *surface, cell *c, uint16_t idx) {
+    termpaintp_cell_patch_release(surface, c);
+    c->attr_patch_idx = idx;
+    termpaintp_cell_patch_retain(surface, c);
 }
 
 void termpaint_surface_write_with_colors(termpaint_surface *surface, int x, int y, const char *string, int fg, int bg) {
@@ -938,6 +1360,7 @@ static void termpaintp_surface_vanish_char(termpaint_surface *surface, int x, in
         do {
             cell = termpaintp_getcell(surface, i, y);
 
+            termpaintp_cell_text_release(cell);
             cell->text_len = 1;
             cell->text[0] = ' ';
             // cell->cluster_expansion == 0 already unless this is the last iteration, see fixup below
@@ -952,6 +1375,7 @@ static void termpaintp_surface_vanish_char(termpaint_surface *surface, int x, in
         int expansion = cell->cluster_expansion;
         int j = 0;
         while (1) {
+            termpaintp_cell_text_release(cell);
             cell->cluster_expansion = 0;
             cell->text_len = 1;
             cell->text[0] = ' ';
@@ -965,90 +1389,455 @@ static void termpaintp_surface_vanish_char(termpaint_surface *surface, int x, in
     }
 }
 
-static void termpaintp_surface_attr_apply(termpaint_surface *surface, cell *cell, termpaint_attr const *attr) {
+// An attribute with the patch already looked up in the patch table of a surface.
+typedef struct termpaintp_resolved_attr_ {
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t deco_color;
+    uint16_t flags;
+    uint16_t patch_idx;
+} termpaintp_resolved_attr;
+
+// The patch index is only valid until the next call to termpaintp_surface_ensure_patch_idx, unless a reference is
+// held.
+static void termpaintp_surface_resolve_attr(termpaint_surface *surface, termpaintp_resolved_attr *resolved,
+                                            termpaint_attr const *attr) {
+    resolved->fg_color = attr->fg_color;
+    resolved->bg_color = attr->bg_color;
+    resolved->deco_color = attr->deco_color;
+    resolved->flags = attr->flags;
+    resolved->patch_idx = termpaintp_surface_ensure_patch_idx(surface, attr->patch_optimize,
+                                                              attr->patch_setup, attr->patch_cleanup);
+}
+
+static inline void termpaintp_surface_attr_apply(termpaint_surface *surface, cell *cell,
+                                                 const termpaintp_resolved_attr *attr) {
     cell->fg_color = attr->fg_color;
     cell->bg_color = attr->bg_color;
     cell->deco_color = attr->deco_color;
     cell->flags = attr->flags;
-    cell->attr_patch_idx = termpaintp_surface_ensure_patch_idx(surface, attr->patch_optimize,
-                                                               attr->patch_setup, attr->patch_cleanup);
+    termpaintp_cell_set_patch_idx(surface, cell, attr->patch_idx);
 }
 
+#define TERMPAINTP_UTF8_VALIDATION_CHUNK 256
+
+// Writes characters that each form a cluster on their own and use one cell with the same attributes.
+// narrow contract: x >= 0, x + len <= width
+static void termpaintp_surface_write_ascii_run(termpaint_surface *surface, int x, int y, const unsigned char *string,
+                                               int len, const termpaintp_resolved_attr *attr) {
+    termpaintp_surface_vanish_char(surface, x, y, len);
+
+    cell *c = termpaintp_getcell(surface, x, y);
+    for (int i = 0; i < len; i++, c++) {
+        termpaintp_surface_attr_apply(surface, c, attr);
+        // vanish_char already released the old text and reset cluster_expansion
+        c->text[0] = string[i];
+        c->text_len = 1;
+    }
+}
+
+static void termpaintp_surface_write_resolved(termpaint_surface *surface, int x, int y, const unsigned char *string,
+                                              int len, const termpaintp_resolved_attr *attr,
+                                              int clip_x0, int clip_x1,
+                                              int max_width, termpaint_write_result *result);
+
 void termpaint_surface_write_with_attr_clipped(termpaint_surface *surface, int x, int y, const char *string_s, termpaint_attr const *attr, int clip_x0, int clip_x1) {
     int len = strlen(string_s);
     termpaint_surface_write_with_len_attr_clipped(surface, x, y, string_s, len, attr, clip_x0, clip_x1);
 }
 
 void termpaint_surface_write_with_len_attr_clipped(termpaint_surface *surface, int x, int y, const char *string_s, int len, termpaint_attr const *attr, int clip_x0, int clip_x1) {
-    const termpaintp_width *char_width_table = surface->terminal->char_width_table;
-    const unsigned char *string = (const unsigned char *)string_s;
-    if (y < 0) return;
-    if (clip_x0 < 0) clip_x0 = 0;
-    if (clip_x1 >= surface->width) {
-        clip_x1 = surface->width-1;
+    termpaintp_resolved_attr resolved;
+    termpaintp_surface_resolve_attr(surface, &resolved, attr);
+    termpaintp_surface_write_resolved(surface, x, y, (const unsigned char *)string_s, len, &resolved, clip_x0, clip_x1,
+                                      -1, nullptr);
+}
+
+void termpaint_surface_write_measured_with_colors(termpaint_surface *surface, int x, int y, const char *string, int len, int fg, int bg, int max_width, const char *ellipsis, termpaint_write_result *result) {
+    termpaint_attr attr;
+    attr.fg_color = fg;
+    attr.bg_color = bg;
+    attr.deco_color = TERMPAINT_DEFAULT_COLOR;
+    attr.flags = 0;
+    attr.patch_setup = nullptr;
+    attr.patch_cleanup = nullptr;
+    attr.patch_optimize = false;
+    termpaint_surface_write_measured_with_attr(surface, x, y, string, len, &attr, max_width, ellipsis, result);
+}
+
+// Width of the first cluster in string, as write would use it.
+static int termpaintp_first_cluster_width(const termpaintp_width *char_width_table, const unsigned char *string) {
+    int size = termpaintp_utf8_len(string[0]);
+    if (strnlen((const char*)string, size) < (size_t)size) {
+        return 1;
     }
-    while (len) {
-        if (x > clip_x1 || y >= surface->height) {
-            return;
+    int codepoint = 0xFFFD;
+    if (string[0] < 0x80) {
+        codepoint = string[0];
+    } else if (termpaintp_check_valid_sequence(string, size)) {
+        codepoint = termpaintp_utf8_decode_from_utf8(string, size);
+    }
+    if (codepoint == '\x7f') {
+        return 1;
+    }
+    int width = termpaintp_char_width(char_width_table, replace_unusable_codepoints(codepoint));
+    // if start is 0 width U+00a0 is used as base
+    return width ? width : 1;
+}
+
+void termpaint_surface_write_measured_with_attr(termpaint_surface *surface, int x, int y, const char *string, int len, const termpaint_attr *attr, int max_width, const char *ellipsis, termpaint_write_result *result) {
+    const unsigned char *ustring = (const unsigned char *)string;
+    if (len < 0) {
+        len = strlen(string);
+    }
+    termpaint_write_result tmp;
+    if (!result) {
+        result = &tmp;
+    }
+
+    termpaintp_resolved_attr resolved;
+    termpaintp_surface_resolve_attr(surface, &resolved, attr);
+
+    int ellipsis_width = 0;
+    if (max_width >= 0 && ellipsis && *ellipsis) {
+        ellipsis_width = termpaintp_first_cluster_width(surface->terminal->char_width_table,
+                                                        (const unsigned char *)ellipsis);
+        if (ellipsis_width > max_width) {
+            ellipsis_width = 0;
         }
+    }
+
+    if (!ellipsis_width) {
+        termpaintp_surface_write_resolved(surface, x, y, ustring, len, &resolved, 0, surface->width - 1,
+                                          max_width, result);
+        return;
+    }
+
+    // Write everything that fits even when the ellipsis is needed. Only the rest (if it fits at most the columns
+    // left after the head) needs to be looked at a second time.
+    termpaint_write_result head;
+    termpaintp_surface_write_resolved(surface, x, y, ustring, len, &resolved, 0, surface->width - 1,
+                                      max_width - ellipsis_width, &head);
+    if (!head.truncated) {
+        *result = head;
+        return;
+    }
+
+    const int remaining_width = max_width - (head.end_x - x);
+    termpaint_write_result tail;
+    termpaintp_surface_write_resolved(surface, head.end_x, -1, ustring + head.bytes, len - head.bytes, &resolved,
+                                      0, surface->width - 1, remaining_width, &tail);
+    if (!tail.truncated) {
+        termpaintp_surface_write_resolved(surface, head.end_x, y, ustring + head.bytes, len - head.bytes, &resolved,
+                                          0, surface->width - 1, remaining_width, &tail);
+        result->end_x = tail.end_x;
+        result->bytes = head.bytes + tail.bytes;
+        result->clusters = head.clusters + tail.clusters;
+        result->truncated = false;
+    } else {
+        termpaintp_surface_write_resolved(surface, head.end_x, y, (const unsigned char *)ellipsis, strlen(ellipsis),
+                                          &resolved, 0, surface->width - 1, ellipsis_width, &tail);
+        result->end_x = tail.end_x;
+        result->bytes = head.bytes;
+        result->clusters = head.clusters + tail.clusters;
+        result->truncated = true;
+    }
+}
+
+#define TERMPAINTP_SPAN_ATTR_CACHE_SIZE 16
+
+void termpaint_surface_write_spans(termpaint_surface *surface, const termpaint_write_span *spans, int count) {
+    // Spans typically share a few attributes, so resolve each attribute only once per batch. The cache holds
+    // references on the patches, so they stay valid while resolving other attributes.
+    const termpaint_attr *cached_attrs[TERMPAINTP_SPAN_ATTR_CACHE_SIZE];
+    termpaintp_resolved_attr cached_resolved[TERMPAINTP_SPAN_ATTR_CACHE_SIZE];
+    int cached = 0;
+    int next_evict = 0;
+
+    for (int i = 0; i < count; i++) {
+        const termpaint_write_span *span = &spans[i];
+
+        int slot = -1;
+        for (int j = 0; j < cached; j++) {
+            if (cached_attrs[j] == span->attr) {
+                slot = j;
+                break;
+            }
+        }
+        if (slot == -1) {
+            if (cached < TERMPAINTP_SPAN_ATTR_CACHE_SIZE) {
+                slot = cached++;
+            } else {
+                slot = next_evict;
+                next_evict = (next_evict + 1) % TERMPAINTP_SPAN_ATTR_CACHE_SIZE;
+                termpaintp_surface_patch_release(surface, cached_resolved[slot].patch_idx);
+            }
+            cached_attrs[slot] = span->attr;
+            termpaintp_surface_resolve_attr(surface, &cached_resolved[slot], span->attr);
+            termpaintp_surface_patch_retain(surface, cached_resolved[slot].patch_idx);
+        }
+
+        int len = span->len >= 0 ? span->len : (int)strlen(span->string);
+        termpaintp_surface_write_resolved(surface, span->x, span->y, (const unsigned char *)span->string, len,
+                                          &cached_resolved[slot], span->clip_x0, span->clip_x1, -1, nullptr);
+    }
+
+    for (int j = 0; j < cached; j++) {
+        termpaintp_surface_patch_release(surface, cached_resolved[j].patch_idx);
+    }
+}
+
+static bool termpaintp_prepared_text_segment(termpaint_prepared_text *text, const termpaintp_width *char_width_table);
+
+int termpaint_surface_write_prepared_with_colors(termpaint_surface *surface, int x, int y, termpaint_prepared_text *text, int fg, int bg, int max_width) {
+    termpaint_attr attr;
+    attr.fg_color = fg;
+    attr.bg_color = bg;
+    attr.deco_color = TERMPAINT_DEFAULT_COLOR;
+    attr.flags = 0;
+    attr.patch_setup = nullptr;
+    attr.patch_cleanup = nullptr;
+    attr.patch_optimize = false;
+    return termpaint_surface_write_prepared_with_attr(surface, x, y, text, &attr, max_width);
+}
+
+int termpaint_surface_write_prepared_with_attr(termpaint_surface *surface, int x, int y, termpaint_prepared_text *text, const termpaint_attr *attr, int max_width) {
+    if (text->char_width_table != surface->terminal->char_width_table) {
+        // The terminal switched to a different width table after the text was prepared (e.g. after auto detection),
+        // the prepared clusters would not match what the terminal displays. Replace them once for the new table.
+        termpaintp_prepared_cluster *old_clusters = text->clusters;
+        unsigned char *old_text = text->text;
+        if (!termpaintp_prepared_text_segment(text, surface->terminal->char_width_table)) {
+            termpaintp_oom(surface->terminal);
+        }
+        free(old_clusters);
+        free(old_text);
+    }
+
+    int count = text->cluster_count;
+    int used = text->width;
+    if (max_width >= 0 && used > max_width) {
+        count = 0;
+        used = 0;
+        while (count < text->cluster_count && used + text->clusters[count].width <= max_width) {
+            used += text->clusters[count].width;
+            ++count;
+        }
+    }
+
+    if (y < 0 || y >= surface->height) {
+        return used;
+    }
+    const int start = x < 0 ? 0 : x;
+    const int end = x + used > surface->width ? surface->width : x + used;
+    if (start >= end) {
+        return used;
+    }
+
+    termpaintp_resolved_attr resolved;
+    termpaintp_surface_resolve_attr(surface, &resolved, attr);
+
+    termpaintp_surface_prepare_modify_rows(surface, y, 1);
+    // after this all cells in the range are single cell clusters without text that needs to be released
+    termpaintp_surface_vanish_char(surface, start, y, end - start);
+
+    int cluster_x = x;
+    for (int i = 0; i < count && cluster_x < end; i++) {
+        const termpaintp_prepared_cluster *cluster = &text->clusters[i];
+        const int cluster_width = cluster->width;
+
+        if (cluster_x + cluster_width <= start) {
+            // completely left of the surface
+        } else if (cluster_x < start || cluster_x + cluster_width > end) {
+            // char is split by the edge of the surface. Fill in the visible part as if the char was split later
+            const int visible_end = cluster_x + cluster_width > end ? end : cluster_x + cluster_width;
+            for (int j = cluster_x < start ? start : cluster_x; j < visible_end; j++) {
+                cell *c = termpaintp_getcell(surface, j, y);
+                termpaintp_surface_attr_apply(surface, c, &resolved);
+            }
+        } else {
+            cell *c = termpaintp_getcell(surface, cluster_x, y);
+            termpaintp_surface_attr_apply(surface, c, &resolved);
+            c->cluster_expansion = cluster_width - 1;
+            if (cluster->text_len <= 8) {
+                if (cluster->text_len) {
+                    memcpy(c->text, text->text + cluster->text_offset, cluster->text_len);
+                    c->text_len = cluster->text_len;
+                } else {
+                    c->text_len = 0;
+                    c->text_overflow = nullptr;
+                }
+            } else {
+                termpaintp_set_overflow_text(surface, c, text->text + cluster->text_offset);
+            }
+            for (int j = 1; j < cluster_width; j++) {
+                cell *c = termpaintp_getcell(surface, cluster_x + j, y);
+                termpaintp_surface_attr_apply(surface, c, &resolved);
+                c->text_len = 0;
+                c->text_overflow = WIDE_RIGHT_PADDING;
+            }
+        }
+        cluster_x += cluster_width;
+    }
+
+    return used;
+}
 
-        unsigned char cluster_utf8[40];
-        int cluster_width = 1;
-        int input_bytes_used = 0;
-        size_t output_bytes_used = 0;
+#define TERMPAINTP_CLUSTER_UTF8_SIZE 40
 
-        // ATTENTION keep this in sync with termpaint_text_measurement_feed_codepoint
-        while (len - input_bytes_used) {
-            int size = termpaintp_utf8_len(string[input_bytes_used]);
+// Decodes the cluster at the start of string into cluster_utf8, which must have room for TERMPAINTP_CLUSTER_UTF8_SIZE
+// bytes. *validated_end tracks how much of the input is already known to consist of valid complete sequences.
+// Returns the number of input bytes used by the cluster or -1 if the input ends in an incomplete sequence.
+static int termpaintp_next_cluster(const termpaintp_width *char_width_table, const unsigned char *string, int len,
+                                   const unsigned char **validated_end, unsigned char *cluster_utf8,
+                                   int *cluster_width_out, int *output_bytes_used_out) {
+    int cluster_width = 1;
+    int input_bytes_used = 0;
+    int output_bytes_used = 0;
+
+    // ATTENTION keep this in sync with termpaint_text_measurement_feed_codepoint
+    while (len - input_bytes_used) {
+        int size = termpaintp_utf8_len(string[input_bytes_used]);
+
+        if (string + input_bytes_used >= *validated_end) {
+            int chunk = len - input_bytes_used < TERMPAINTP_UTF8_VALIDATION_CHUNK
+                    ? len - input_bytes_used : TERMPAINTP_UTF8_VALIDATION_CHUNK;
+            *validated_end = string + input_bytes_used
+                    + termpaintp_utf8_valid_prefix(string + input_bytes_used, chunk);
+        }
 
+        int codepoint;
+        if (string + input_bytes_used + size <= *validated_end) {
+            codepoint = termpaintp_utf8_decode_from_utf8(string + input_bytes_used, size);
+        } else {
             // check termpaintp_utf8_decode_from_utf8 precondition
             if (input_bytes_used + size > len) {
                 // bogus, bail
-                return;
+                return -1;
             }
-            int codepoint;
             if (termpaintp_check_valid_sequence(string + input_bytes_used, size)) {
                 codepoint = termpaintp_utf8_decode_from_utf8(string + input_bytes_used, size);
             } else {
                 // This is bogus usage, but just paper over it
                 codepoint = 0xFFFD;
             }
+        }
 
-            if (codepoint != '\x7f' || output_bytes_used != 0) {
-                codepoint = replace_unusable_codepoints(codepoint);
+        if (codepoint != '\x7f' || output_bytes_used != 0) {
+            codepoint = replace_unusable_codepoints(codepoint);
 
-                int width = termpaintp_char_width(char_width_table, codepoint);
+            int width = termpaintp_char_width(char_width_table, codepoint);
 
-                if (!output_bytes_used) {
-                    if (width == 0) {
-                        // if start is 0 width use U+00a0 as base
-                        output_bytes_used += termpaintp_encode_to_utf8(0xa0, cluster_utf8 + output_bytes_used);
-                    } else {
-                        cluster_width = width;
-                    }
-                    output_bytes_used += termpaintp_encode_to_utf8(codepoint, cluster_utf8 + output_bytes_used);
+            if (!output_bytes_used) {
+                if (width == 0) {
+                    // if start is 0 width use U+00a0 as base
+                    output_bytes_used += termpaintp_encode_to_utf8(0xa0, cluster_utf8 + output_bytes_used);
                 } else {
-                    if (width > 0) {
-                        // don't increase input_bytes_used here because this codepoint will need to be reprocessed.
-                        break;
-                    }
-                    if (output_bytes_used + 6 < sizeof (cluster_utf8)) {
-                        output_bytes_used += termpaintp_encode_to_utf8(codepoint, cluster_utf8 + output_bytes_used);
-                    } else {
-                        // just ignore further combining codepoints, likely this is way over the limit
-                        // of the terminal anyway
-                    }
+                    cluster_width = width;
                 }
+                output_bytes_used += termpaintp_encode_to_utf8(codepoint, cluster_utf8 + output_bytes_used);
             } else {
-                output_bytes_used = 0;
-                input_bytes_used += size;
-                // do not allow any non spacing modifiers
-                break;
+                if (width > 0) {
+                    // don't increase input_bytes_used here because this codepoint will need to be reprocessed.
+                    break;
+                }
+                if (output_bytes_used + 6 < TERMPAINTP_CLUSTER_UTF8_SIZE) {
+                    output_bytes_used += termpaintp_encode_to_utf8(codepoint, cluster_utf8 + output_bytes_used);
+                } else {
+                    // just ignore further combining codepoints, likely this is way over the limit
+                    // of the terminal anyway
+                }
             }
+        } else {
+            output_bytes_used = 0;
             input_bytes_used += size;
+            // do not allow any non spacing modifiers
+            break;
+        }
+        input_bytes_used += size;
+    }
+
+    *cluster_width_out = cluster_width;
+    *output_bytes_used_out = output_bytes_used;
+    return input_bytes_used;
+}
+
+// Writes clusters until a cluster would exceed max_width columns (if max_width >= 0). If result is not null the
+// results are stored there and clusters that are clipped or in rows outside of the surface are still measured, so
+// passing y = -1 only measures.
+static void termpaintp_surface_write_resolved(termpaint_surface *surface, int x, int y, const unsigned char *string,
+                                              int len, const termpaintp_resolved_attr *attr,
+                                              int clip_x0, int clip_x1,
+                                              int max_width, termpaint_write_result *result) {
+    const termpaintp_width *char_width_table = surface->terminal->char_width_table;
+    bool writing = y >= 0 && y < surface->height;
+    if (!writing && !result) return;
+    if (clip_x0 < 0) clip_x0 = 0;
+    if (clip_x1 >= surface->width) {
+        clip_x1 = surface->width-1;
+    }
+    if (writing) {
+        termpaintp_surface_prepare_modify_rows(surface, y, 1);
+    }
+    const unsigned char *const string_start = string;
+    int clusters = 0;
+    int used_width = 0;
+    bool truncated = false;
+    // input before this is known to consist of valid complete sequences. Validation is done in chunks, so writes
+    // that are clipped early don't need to look at all of the input.
+    const unsigned char *validated_end = string;
+    while (len) {
+        if (writing && x > clip_x1) {
+            if (!result) {
+                return;
+            }
+            writing = false;
+        }
+
+        if (x >= clip_x0 || !writing) {
+            // fast path for printable ASCII, each character is a single width cluster.
+            int run = termpaintp_utf8_printable_ascii_prefix(string, len);
+            if (run < len && string[run] >= 0x80) {
+                // the last character might get combined with following non spacing marks
+                --run;
+            }
+            if (max_width >= 0 && run > max_width - used_width) {
+                run = max_width - used_width;
+            }
+            if (writing && run > clip_x1 - x + 1) {
+                run = clip_x1 - x + 1;
+            }
+            if (run > 0) {
+                if (writing) {
+                    termpaintp_surface_write_ascii_run(surface, x, y, string, run, attr);
+                }
+                string += run;
+                len -= run;
+                x += run;
+                clusters += run;
+                used_width += run;
+                continue;
+            }
+        }
+
+        unsigned char cluster_utf8[TERMPAINTP_CLUSTER_UTF8_SIZE];
+        int cluster_width;
+        int output_bytes_used;
+        int input_bytes_used = termpaintp_next_cluster(char_width_table, string, len, &validated_end,
+                                                       cluster_utf8, &cluster_width, &output_bytes_used);
+        if (input_bytes_used < 0) {
+            // bailed out on an incomplete sequence
+            break;
         }
 
-        if (cluster_width == 2 && x + 1 == clip_x0) {
+        if (max_width >= 0 && used_width + cluster_width > max_width) {
+            truncated = true;
+            break;
+        }
+
+        if (!writing) {
+            // only measuring
+        } else if (cluster_width == 2 && x + 1 == clip_x0) {
             // char is split by clipping boundary. Fill in right half as if the char was split later
             cell *c = termpaintp_getcell(surface, x + 1, y);
 
@@ -1102,6 +1891,15 @@ void termpaint_surface_write_with_len_attr_clipped(termpaint_surface *surface, i
         len -= input_bytes_used;
 
         x = x + cluster_width;
+        clusters += 1;
+        used_width += cluster_width;
+    }
+
+    if (result) {
+        result->end_x = x;
+        result->bytes = string - string_start;
+        result->clusters = clusters;
+        result->truncated = truncated;
     }
 }
 
@@ -1137,11 +1935,13 @@ static void termpaintp_surface_clear_rect_with_attr_and_string(termpaint_surface
     if (y >= surface->height) return;
     if (x+width > surface->width) width = surface->width - x;
     if (y+height > surface->height) height = surface->height - y;
+    termpaintp_surface_prepare_modify_rows(surface, y, height);
     for (int y1 = y; y1 < y + height; y1++) {
         termpaintp_surface_vanish_char(surface, x, y1, 1);
         termpaintp_surface_vanish_char(surface, x + width - 1, y1, 1);
         for (int x1 = x; x1 < x + width; x1++) {
             cell* c = termpaintp_getcell(surface, x1, y1);
+            termpaintp_cell_text_release(c);
             c->cluster_expansion = 0;
             if (str) {
                 c->text_len = len;
@@ -1154,7 +1954,7 @@ static void termpaintp_surface_clear_rect_with_attr_and_string(termpaint_surface
             c->fg_color = attr->fg_color;
             c->deco_color = TERMPAINT_DEFAULT_COLOR;
             c->flags = attr->flags;
-            c->attr_patch_idx = 0;
+            termpaintp_cell_set_patch_idx(surface, c, 0);
         }
     }
 }
@@ -1211,6 +2011,8 @@ void termpaint_surface_set_fg_color(const termpaint_surface *surface, int x, int
     if (y < 0) return;
     if (x >= surface->width) return;
     if (y >= surface->height) return;
+    // The public signature takes a const surface for historic reasons, but the surface is modified.
+    termpaintp_surface_prepare_modify_rows((termpaint_surface*)surface, y, 1);
     cell* c = termpaintp_getcell(surface, x, y);
 
     if (c->text_len == 0 && c->text_overflow == WIDE_RIGHT_PADDING) {
@@ -1231,6 +2033,7 @@ void termpaint_surface_set_bg_color(const termpaint_surface *surface, int x, int
     if (y < 0) return;
     if (x >= surface->width) return;
     if (y >= surface->height) return;
+    termpaintp_surface_prepare_modify_rows((termpaint_surface*)surface, y, 1);
     cell* c = termpaintp_getcell(surface, x, y);
 
     if (c->text_len == 0 && c->text_overflow == WIDE_RIGHT_PADDING) {
@@ -1251,6 +2054,7 @@ void termpaint_surface_set_deco_color(const termpaint_surface *surface, int x, i
     if (y < 0) return;
     if (x >= surface->width) return;
     if (y >= surface->height) return;
+    termpaintp_surface_prepare_modify_rows((termpaint_surface*)surface, y, 1);
     cell* c = termpaintp_getcell(surface, x, y);
 
     if (c->text_len == 0 && c->text_overflow == WIDE_RIGHT_PADDING) {
@@ -1266,11 +2070,130 @@ void termpaint_surface_set_deco_color(const termpaint_surface *surface, int x, i
     }
 }
 
+static bool termpaintp_surface_clip_rect(const termpaint_surface *surface, int *x, int *y, int *width, int *height) {
+    if (*x < 0) {
+        *width += *x;
+        *x = 0;
+    }
+    if (*y < 0) {
+        *height += *y;
+        *y = 0;
+    }
+    if (*width <= 0) return false;
+    if (*height <= 0) return false;
+    if (*x >= surface->width) return false;
+    if (*y >= surface->height) return false;
+    if (*x + *width > surface->width) *width = surface->width - *x;
+    if (*y + *height > surface->height) *height = surface->height - *y;
+    return true;
+}
+
+static unsigned termpaintp_flags_set_style(unsigned flags, int bits) {
+    flags |= bits & TERMPAINT_STYLE_PASSTHROUGH;
+    if (bits & ~TERMPAINT_STYLE_PASSTHROUGH) {
+        if (bits & TERMPAINT_STYLE_UNDERLINE) {
+            flags = (flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_SINGLE;
+        } else if (bits & TERMPAINT_STYLE_UNDERLINE_DBL) {
+            flags = (flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_DOUBLE;
+        } else if (bits & TERMPAINT_STYLE_UNDERLINE_CURLY) {
+            flags = (flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_CURLY;
+        }
+    }
+    return flags;
+}
+
+static unsigned termpaintp_flags_unset_style(unsigned flags, int bits) {
+    flags &= ~bits | ~TERMPAINT_STYLE_PASSTHROUGH;
+    if (bits & (TERMPAINT_STYLE_UNDERLINE | TERMPAINT_STYLE_UNDERLINE_DBL | TERMPAINT_STYLE_UNDERLINE_CURLY)) {
+        flags &= ~CELL_ATTR_UNDERLINE_MASK;
+    }
+    return flags;
+}
+
+enum termpaintp_rect_op {
+    TERMPAINTP_RECT_FG,
+    TERMPAINTP_RECT_BG,
+    TERMPAINTP_RECT_DECO,
+    TERMPAINTP_RECT_SET_STYLE,
+    TERMPAINTP_RECT_UNSET_STYLE,
+};
+
+// Applies op to all clusters that start inside the rectangle. Like the single cell functions clusters are changed as
+// a whole, even if they extend past the right edge of the rectangle, and clusters starting left of the rectangle
+// are not changed.
+static void termpaintp_surface_modify_rect(termpaint_surface *surface, int x, int y, int width, int height,
+                                           enum termpaintp_rect_op op, unsigned value) {
+    if (!termpaintp_surface_clip_rect(surface, &x, &y, &width, &height)) {
+        return;
+    }
+    termpaintp_surface_prepare_modify_rows(surface, y, height);
+    for (int y1 = y; y1 < y + height; y1++) {
+        cell *row = termpaintp_getcell(surface, 0, y1);
+        int x1 = x;
+        while (x1 < x + width && termpaintp_cell_is_wide_right_padding(&row[x1])) {
+            x1++;
+        }
+        while (x1 < x + width) {
+            cell *c = &row[x1];
+            int end = x1 + c->cluster_expansion + 1;
+            switch (op) {
+                case TERMPAINTP_RECT_FG:
+                    for (; x1 < end; x1++) {
+                        row[x1].fg_color = value;
+                    }
+                    break;
+                case TERMPAINTP_RECT_BG:
+                    for (; x1 < end; x1++) {
+                        row[x1].bg_color = value;
+                    }
+                    break;
+                case TERMPAINTP_RECT_DECO:
+                    for (; x1 < end; x1++) {
+                        row[x1].deco_color = value;
+                    }
+                    break;
+                case TERMPAINTP_RECT_SET_STYLE:
+                    for (; x1 < end; x1++) {
+                        row[x1].flags = termpaintp_flags_set_style(row[x1].flags, (int)value);
+                    }
+                    break;
+                case TERMPAINTP_RECT_UNSET_STYLE:
+                    for (; x1 < end; x1++) {
+                        row[x1].flags = termpaintp_flags_unset_style(row[x1].flags, (int)value);
+                    }
+                    break;
+            }
+        }
+    }
+}
+
+void termpaint_surface_set_fg_color_rect(termpaint_surface *surface, int x, int y, int width, int height, unsigned fg) {
+    termpaintp_surface_modify_rect(surface, x, y, width, height, TERMPAINTP_RECT_FG, fg);
+}
+
+void termpaint_surface_set_bg_color_rect(termpaint_surface *surface, int x, int y, int width, int height, unsigned bg) {
+    termpaintp_surface_modify_rect(surface, x, y, width, height, TERMPAINTP_RECT_BG, bg);
+}
+
+void termpaint_surface_set_deco_color_rect(termpaint_surface *surface, int x, int y, int width, int height,
+                                           unsigned deco_color) {
+    termpaintp_surface_modify_rect(surface, x, y, width, height, TERMPAINTP_RECT_DECO, deco_color);
+}
+
+void termpaint_surface_set_style_rect(termpaint_surface *surface, int x, int y, int width, int height, int bits) {
+    termpaintp_surface_modify_rect(surface, x, y, width, height, TERMPAINTP_RECT_SET_STYLE, (unsigned)bits);
+}
+
+void termpaint_surface_unset_style_rect(termpaint_surface *surface, int x, int y, int width, int height, int bits) {
+    termpaintp_surface_modify_rect(surface, x, y, width, height, TERMPAINTP_RECT_UNSET_STYLE, (unsigned)bits);
+}
+
 void termpaint_surface_set_softwrap_marker(termpaint_surface *surface, int x, int y, bool state) {
     if (x < 0) return;
     if (y < 0) return;
     if (x >= surface->width) return;
     if (y >= surface->height) return;
+    termpaintp_surface_prepare_modify_rows(surface, y, 1);
     cell* c = termpaintp_getcell(surface, x, y);
 
     if (c->text_len == 0 && c->text_overflow == WIDE_RIGHT_PADDING) {
@@ -1287,8 +2210,8 @@ void termpaint_surface_set_softwrap_marker(termpaint_surface *surface, int x, in
 
 bool termpaint_surface_resize_mustcheck(termpaint_surface *surface, int width, int height) {
     if (width < 0 || height < 0) {
-        free(surface->cells);
-        free(surface->cells_last_flush);
+        termpaintp_surface_release_cells(surface);
+        termpaintp_surface_discard_row_hashes(surface);
         termpaintp_collapse(surface);
     } else {
         if (!termpaintp_resize_mustcheck(surface, width, height)) {
@@ -1312,29 +2235,31 @@ int termpaint_surface_height(const termpaint_surface *surface) {
     return surface->height;
 }
 
-static void termpaintp_surface_gc_mark_cb(termpaint_hash *hash) {
-    termpaint_surface *surface = container_of(hash, termpaint_surface, overflow_text);
-
-    for (int y = 0; y < surface->height; y++) {
-        for (int x = 0; x < surface->width; x++) {
-            cell* c = termpaintp_getcell(surface, x, y);
-            if (c->text_len == 0 && c->text_overflow != nullptr && c->text_overflow != WIDE_RIGHT_PADDING) {
-                c->text_overflow->unused = false;
-            }
-            if (surface->cells_last_flush) {
-                cell* old_c = &surface->cells_last_flush[y*surface->width+x];
-                if (old_c->text_len == 0 && old_c->text_overflow != nullptr && c->text_overflow != WIDE_RIGHT_PADDING) {
-                    old_c->text_overflow->unused = false;
-                }
+static void termpaintp_overflow_text_gc_mark_cb(termpaint_hash *hash) {
+    // Reference counts are maintained on each cell modification, so marking only needs to look at the
+    // hash itself instead of scanning all cells.
+    for (int i = 0; i < hash->allocated; i++) {
+        termpaint_hash_item* item_it = hash->buckets[i];
+        while (item_it) {
+            if (container_of(item_it, termpaintp_overflow_text, base)->refcount) {
+                item_it->unused = false;
             }
+            item_it = item_it->next;
         }
     }
 }
 
 static void termpaintp_surface_init(termpaint_surface *surface, termpaint_terminal *term) {
-    surface->overflow_text.gc_mark_cb = termpaintp_surface_gc_mark_cb;
-    surface->overflow_text.item_size = sizeof(termpaint_hash_item);
     surface->terminal = term;
+    surface->overflow_text = &term->overflow_text;
+}
+
+static void termpaintp_surface_share_overflow_text(termpaint_surface *surface, const termpaint_surface *src) {
+    surface->overflow_text = src->overflow_text;
+    surface->private_overflow_text = src->private_overflow_text;
+    if (surface->private_overflow_text) {
+        surface->private_overflow_text->refcount++;
+    }
 }
 
 termpaint_surface *termpaint_terminal_new_surface_or_nullptr(termpaint_terminal *term, int width, int height) {
@@ -1342,8 +2267,39 @@ termpaint_surface *termpaint_terminal_new_surface_or_nullptr(termpaint_terminal
     if (!ret) {
         return nullptr;
     }
-    termpaintp_surface_init(ret, term);
-    termpaintp_collapse(ret);
+    termpaintp_surface_init(ret, term);
+    termpaintp_collapse(ret);
+    if (!termpaintp_resize_mustcheck(ret, width, height)) {
+        termpaint_surface_free(ret);
+        return nullptr;
+    }
+    return ret;
+}
+
+termpaint_surface *termpaint_terminal_new_surface(termpaint_terminal *term, int width, int height) {
+    termpaint_surface *ret = termpaint_terminal_new_surface_or_nullptr(term, width, height);
+    if (!ret) {
+        termpaintp_oom(term);
+    }
+    return ret;
+}
+
+termpaint_surface *termpaint_terminal_new_worker_surface_or_nullptr(termpaint_terminal *term, int width, int height) {
+    termpaint_surface *ret = calloc(1, sizeof(termpaint_surface));
+    if (!ret) {
+        return nullptr;
+    }
+    termpaintp_surface_init(ret, term);
+    termpaintp_collapse(ret);
+    ret->private_overflow_text = calloc(1, sizeof(termpaintp_private_overflow_text));
+    if (!ret->private_overflow_text) {
+        free(ret);
+        return nullptr;
+    }
+    ret->private_overflow_text->refcount = 1;
+    ret->private_overflow_text->hash.item_size = sizeof(termpaintp_overflow_text);
+    ret->private_overflow_text->hash.gc_mark_cb = termpaintp_overflow_text_gc_mark_cb;
+    ret->overflow_text = &ret->private_overflow_text->hash;
     if (!termpaintp_resize_mustcheck(ret, width, height)) {
         termpaint_surface_free(ret);
         return nullptr;
@@ -1351,14 +2307,30 @@ termpaint_surface *termpaint_terminal_new_surface_or_nullptr(termpaint_terminal
     return ret;
 }
 
-termpaint_surface *termpaint_terminal_new_surface(termpaint_terminal *term, int width, int height) {
-    termpaint_surface *ret = termpaint_terminal_new_surface_or_nullptr(term, width, height);
+termpaint_surface *termpaint_terminal_new_worker_surface(termpaint_terminal *term, int width, int height) {
+    termpaint_surface *ret = termpaint_terminal_new_worker_surface_or_nullptr(term, width, height);
     if (!ret) {
         termpaintp_oom(term);
     }
     return ret;
 }
 
+// Like termpaint_surface_new_surface, but the new surface shares the overflow text storage of surface.
+static termpaint_surface *termpaintp_surface_new_sharing_overflow_text(termpaint_surface *surface, int width, int height) {
+    termpaint_surface *ret = calloc(1, sizeof(termpaint_surface));
+    if (!ret) {
+        termpaintp_oom(surface->terminal);
+    }
+    termpaintp_surface_init(ret, surface->terminal);
+    termpaintp_surface_share_overflow_text(ret, surface);
+    termpaintp_collapse(ret);
+    if (!termpaintp_resize_mustcheck(ret, width, height)) {
+        termpaint_surface_free(ret);
+        termpaintp_oom(surface->terminal);
+    }
+    return ret;
+}
+
 termpaint_surface *termpaint_surface_new_surface(termpaint_surface *surface, int width, int height) {
     return termpaint_terminal_new_surface(surface->terminal, width, height);
 }
@@ -1387,21 +2359,38 @@ static void termpaintp_copy_colors_and_attibutes(termpaint_surface *src_surface,
     dst_cell->bg_color = src_cell->bg_color;
     dst_cell->deco_color = src_cell->deco_color;
     dst_cell->flags = src_cell->flags;
+    uint16_t patch_idx = 0;
     if (src_cell->attr_patch_idx) {
         termpaintp_patch* patch = &src_surface->patches[src_cell->attr_patch_idx - 1];
-        dst_cell->attr_patch_idx = termpaintp_surface_ensure_patch_idx(dst_surface,
-                                                                       patch->optimize,
-                                                                       patch->setup,
-                                                                       patch->cleanup);
+        patch_idx = termpaintp_surface_ensure_patch_idx(dst_surface,
+                                                        patch->optimize,
+                                                        patch->setup,
+                                                        patch->cleanup);
     }
+    termpaintp_cell_set_patch_idx(dst_surface, dst_cell, patch_idx);
 }
 
 void termpaint_surface_tint(termpaint_surface *surface,
                             void (*recolor)(void *user_data, unsigned *fg, unsigned *bg, unsigned *deco),
                             void *user_data) {
-    for (int y = 0; y < surface->height; y++) {
-        for (int x = 0; x < surface->width; x++) {
-            cell *cell = termpaintp_getcell(surface, x, y);
+    termpaint_surface_tint_rect(surface, 0, 0, surface->width, surface->height, recolor, user_data);
+}
+
+void termpaint_surface_tint_rect(termpaint_surface *surface, int x, int y, int width, int height,
+                                 void (*recolor)(void *user_data, unsigned *fg, unsigned *bg, unsigned *deco),
+                                 void *user_data) {
+    if (!termpaintp_surface_clip_rect(surface, &x, &y, &width, &height)) {
+        return;
+    }
+    termpaintp_surface_prepare_modify_rows(surface, y, height);
+    for (int y1 = y; y1 < y + height; y1++) {
+        int x1 = x;
+        // clusters starting left of the rectangle are not changed
+        while (x1 < x + width && termpaintp_cell_is_wide_right_padding(termpaintp_getcell(surface, x1, y1))) {
+            x1++;
+        }
+        for (; x1 < x + width; x1++) {
+            cell *cell = termpaintp_getcell(surface, x1, y1);
             // Don't give out pointers to internal cell structure contents.
             unsigned fg = cell->fg_color;
             unsigned bg = cell->bg_color;
@@ -1413,12 +2402,82 @@ void termpaint_surface_tint(termpaint_surface *surface,
 
             // update cluster at once, different colors in one cluster are not allowed
             for (int i = 0; i <= expansion; i++) {
-                cell = termpaintp_getcell(surface, x + i, y);
+                cell = termpaintp_getcell(surface, x1 + i, y1);
                 cell->fg_color = fg;
                 cell->bg_color = bg;
                 cell->deco_color = deco;
             }
-            x += expansion;
+            x1 += expansion;
+        }
+    }
+}
+
+void termpaint_color_transform_init(termpaint_color_transform *transform) {
+    transform->fg_default = TERMPAINT_DEFAULT_COLOR;
+    transform->bg_default = TERMPAINT_DEFAULT_COLOR;
+    transform->deco_default = TERMPAINT_DEFAULT_COLOR;
+    for (int i = 0; i < 16; i++) {
+        transform->named[i] = TERMPAINT_NAMED_COLOR + i;
+    }
+    for (int i = 0; i < 256; i++) {
+        transform->indexed[i] = TERMPAINT_INDEXED_COLOR + i;
+    }
+    transform->rgb_target = TERMPAINT_RGB_COLOR(0, 0, 0);
+    transform->rgb_alpha = 0;
+}
+
+static inline uint32_t termpaintp_color_transform_apply(const termpaint_color_transform *transform, uint32_t alpha,
+                                                        uint32_t color, uint32_t default_color) {
+    if ((color & 0xff000000) == TERMPAINT_RGB_COLOR_OFFSET) {
+        // blend red and blue in one multiplication, the lanes are 16 bit wide and can not overflow for alpha <= 256.
+        const uint32_t target = transform->rgb_target;
+        uint32_t rb = ((color & 0xff00ff) * (256 - alpha) + (target & 0xff00ff) * alpha) >> 8;
+        uint32_t g = ((color & 0xff00) * (256 - alpha) + (target & 0xff00) * alpha) >> 8;
+        return TERMPAINT_RGB_COLOR_OFFSET | (rb & 0xff00ff) | (g & 0xff00);
+    } else if (color == TERMPAINT_DEFAULT_COLOR) {
+        return default_color;
+    } else if (color - TERMPAINT_NAMED_COLOR < 16) {
+        return transform->named[color - TERMPAINT_NAMED_COLOR];
+    } else if (color - TERMPAINT_INDEXED_COLOR < 256) {
+        return transform->indexed[color - TERMPAINT_INDEXED_COLOR];
+    }
+    return color;
+}
+
+void termpaint_surface_tint_transform(termpaint_surface *surface, const termpaint_color_transform *transform) {
+    termpaint_surface_tint_rect_transform(surface, 0, 0, surface->width, surface->height, transform);
+}
+
+void termpaint_surface_tint_rect_transform(termpaint_surface *surface, int x, int y, int width, int height,
+                                           const termpaint_color_transform *transform) {
+    if (!termpaintp_surface_clip_rect(surface, &x, &y, &width, &height)) {
+        return;
+    }
+    termpaintp_surface_prepare_modify_rows(surface, y, height);
+
+    uint32_t alpha = transform->rgb_alpha < 0 ? 0 : transform->rgb_alpha > 256 ? 256 : (uint32_t)transform->rgb_alpha;
+    if ((transform->rgb_target & 0xff000000) != TERMPAINT_RGB_COLOR_OFFSET) {
+        alpha = 0;
+    }
+
+    for (int y1 = y; y1 < y + height; y1++) {
+        cell *row = termpaintp_getcell(surface, 0, y1);
+        // Clusters are selected like in termpaint_surface_tint_rect. As all cells of a cluster have the same colors
+        // and the transform is applied independently to each cell, the cells between start and end can be processed
+        // without looking at the cluster structure.
+        int start = x;
+        while (start < x + width && termpaintp_cell_is_wide_right_padding(&row[start])) {
+            start++;
+        }
+        int end = start;
+        while (end < x + width) {
+            end += row[end].cluster_expansion + 1;
+        }
+        for (int x1 = start; x1 < end; x1++) {
+            cell *c = &row[x1];
+            c->fg_color = termpaintp_color_transform_apply(transform, alpha, c->fg_color, transform->fg_default);
+            c->bg_color = termpaintp_color_transform_apply(transform, alpha, c->bg_color, transform->bg_default);
+            c->deco_color = termpaintp_color_transform_apply(transform, alpha, c->deco_color, transform->deco_default);
         }
     }
 }
@@ -1429,6 +2488,7 @@ static void termpaintp_surface_copy_rect_same_surface(termpaint_surface *src_sur
 
 void termpaint_surface_copy_rect(termpaint_surface *src_surface, int x, int y, int width, int height,
                                  termpaint_surface *dst_surface, int dst_x, int dst_y, int tile_left, int tile_right) {
+    termpaintp_surface_prepare_modify_rows(dst_surface, dst_y, height);
     if (x < 0) {
         width += x;
         dst_x -= x;
@@ -1536,7 +2596,7 @@ void termpaint_surface_copy_rect(termpaint_surface *src_surface, int x, int y, i
                             memcpy(dst_scan->text, src_scan->text, src_scan->text_len);
                             dst_scan->text_len = src_scan->text_len;
                         } else if (src_scan->text_len == 0) {
-                            termpaintp_set_overflow_text(dst_surface, dst_scan, src_scan->text_overflow->text);
+                            termpaintp_copy_overflow_text(src_surface, src_scan, dst_surface, dst_scan);
                         }
                     }
                 }
@@ -1603,7 +2663,7 @@ void termpaint_surface_copy_rect(termpaint_surface *src_surface, int x, int y, i
                         dst_cell->text_len = src_cell->text_len;
                     } else if (src_cell->text_len == 0) {
                         if (src_cell->text_overflow != nullptr) {
-                            termpaintp_set_overflow_text(dst_surface, dst_cell, src_cell->text_overflow->text);
+                            termpaintp_copy_overflow_text(src_surface, src_cell, dst_surface, dst_cell);
                         } else {
                             dst_cell->text_len = 0;
                             dst_cell->text_overflow = nullptr;
@@ -1621,7 +2681,9 @@ void termpaint_surface_copy_rect(termpaint_surface *src_surface, int x, int y, i
 static void termpaintp_surface_copy_rect_same_surface(termpaint_surface *dst_surface, int x, int y, int width, int height,
                                                       int dst_x, int dst_y, int tile_left, int tile_right) {
     // precondition: All rectangles are already fully within the surface.
-    termpaint_surface *src_surface = termpaint_surface_new_surface(dst_surface,
+    // The temporary surface uses the overflow text storage of dst_surface, so this does not touch the storage of the
+    // terminal when dst_surface is a worker surface.
+    termpaint_surface *src_surface = termpaintp_surface_new_sharing_overflow_text(dst_surface,
                                                                    width + (x != 0 ? 1 : 0) + ((x + width != dst_surface->width) ? 1 : 0),
                                                                    height + (y != 0 ? 1 : 0) + ((y + height != dst_surface->height) ? 1 : 0));
 
@@ -1636,12 +2698,82 @@ static void termpaintp_surface_copy_rect_same_surface(termpaint_surface *dst_sur
     termpaint_surface_free(src_surface);
 }
 
+static bool termpaintp_surface_clone_patches(const termpaint_surface *src, termpaint_surface *dst) {
+    // precondition: dst has no patches yet
+    if (!src->patches) {
+        return true;
+    }
+    dst->patches = calloc(src->patches_allocated, sizeof(termpaintp_patch));
+    dst->patch_buckets = calloc(src->patch_bucket_mask + 1, sizeof(uint16_t));
+    if (!dst->patches || !dst->patch_buckets) {
+        free(dst->patches);
+        dst->patches = nullptr;
+        free(dst->patch_buckets);
+        dst->patch_buckets = nullptr;
+        return false;
+    }
+    // set allocated early, so a partial clone is freed by termpaintp_surface_destroy
+    dst->patches_allocated = src->patches_allocated;
+    for (int i = 0; i < src->patches_allocated; i++) {
+        const termpaintp_patch *patch = &src->patches[i];
+        dst->patches[i] = *patch;
+        dst->patches[i].setup = nullptr;
+        dst->patches[i].cleanup = nullptr;
+        if (patch->setup) {
+            dst->patches[i].setup = ustrdup(patch->setup);
+            dst->patches[i].cleanup = ustrdup(patch->cleanup);
+            if (!dst->patches[i].setup || !dst->patches[i].cleanup) {
+                return false;
+            }
+        }
+    }
+    memcpy(dst->patch_buckets, src->patch_buckets, (src->patch_bucket_mask + 1) * sizeof(uint16_t));
+    dst->patch_bucket_mask = src->patch_bucket_mask;
+    dst->patches_used = src->patches_used;
+    dst->patch_free = src->patch_free;
+    if (src->cells_last_flush) {
+        // dst does not get the cells of the last flush, so remove their references
+        for (unsigned i = 0; i < src->cells_allocated; i++) {
+            termpaintp_cell_patch_release(dst, &src->cells_last_flush[i]);
+        }
+    }
+    return true;
+}
+
 termpaint_surface *termpaint_surface_duplicate(termpaint_surface *surface) {
-    termpaint_surface *ret = termpaint_surface_new_surface(surface, surface->width, surface->height);
+    // The duplicate shares all rows with surface, rows are only copied when either surface modifies them.
+    termpaint_surface *ret = calloc(1, sizeof(termpaint_surface));
+    if (!ret) {
+        termpaintp_oom(surface->terminal);
+    }
+    termpaintp_surface_init(ret, surface->terminal);
+    termpaintp_surface_share_overflow_text(ret, surface);
+    termpaintp_collapse(ret);
 
-    termpaint_surface_copy_rect(surface, 0, 0, surface->width, surface->height,
-                                ret, 0, 0,
-                                TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    ret->rows = calloc(surface->height ? surface->height : 1, sizeof(termpaintp_row*));
+    if (!ret->rows || !termpaintp_surface_clone_patches(surface, ret)) {
+        termpaintp_surface_destroy(ret);
+        free(ret);
+        termpaintp_oom(surface->terminal);
+    }
+    ret->width = surface->width;
+    ret->height = surface->height;
+    ret->cells_allocated = surface->cells_allocated;
+    for (int y = 0; y < surface->height; y++) {
+        ret->rows[y] = surface->rows[y];
+        ret->rows[y]->refcount++;
+    }
+
+    if (surface->row_hash_valid) {
+        ret->row_hashes = malloc(surface->height * sizeof(uint32_t));
+        ret->row_hash_valid = malloc(surface->height * sizeof(bool));
+        if (ret->row_hashes && ret->row_hash_valid) {
+            memcpy(ret->row_hashes, surface->row_hashes, surface->height * sizeof(uint32_t));
+            memcpy(ret->row_hash_valid, surface->row_hash_valid, surface->height * sizeof(bool));
+        } else {
+            termpaintp_surface_discard_row_hashes(ret);
+        }
+    }
     return ret;
 }
 
@@ -1669,12 +2801,7 @@ unsigned termpaint_surface_peek_deco_color(const termpaint_surface *surface, int
     return cell->deco_color;
 }
 
-int termpaint_surface_peek_style(const termpaint_surface *surface, int x, int y) {
-    cell *cell = termpaintp_getcell_or_null(surface, x, y);
-    if (!cell) {
-        return 0;
-    }
-    unsigned flags = cell->flags;
+static int termpaintp_flags_to_style(unsigned flags) {
     int style = flags & TERMPAINT_STYLE_PASSTHROUGH;
     if ((flags & CELL_ATTR_UNDERLINE_MASK) == CELL_ATTR_UNDERLINE_SINGLE) {
         style |= TERMPAINT_STYLE_UNDERLINE;
@@ -1686,6 +2813,26 @@ int termpaint_surface_peek_style(const termpaint_surface *surface, int x, int y)
     return style;
 }
 
+static uint16_t termpaintp_style_to_flags(int style) {
+    uint16_t flags = style & TERMPAINT_STYLE_PASSTHROUGH;
+    if (style & TERMPAINT_STYLE_UNDERLINE) {
+        flags |= CELL_ATTR_UNDERLINE_SINGLE;
+    } else if (style & TERMPAINT_STYLE_UNDERLINE_DBL) {
+        flags |= CELL_ATTR_UNDERLINE_DOUBLE;
+    } else if (style & TERMPAINT_STYLE_UNDERLINE_CURLY) {
+        flags |= CELL_ATTR_UNDERLINE_CURLY;
+    }
+    return flags;
+}
+
+int termpaint_surface_peek_style(const termpaint_surface *surface, int x, int y) {
+    cell *cell = termpaintp_getcell_or_null(surface, x, y);
+    if (!cell) {
+        return 0;
+    }
+    return termpaintp_flags_to_style(cell->flags);
+}
+
 void termpaint_surface_peek_patch(const termpaint_surface *surface, int x, int y, const char **setup, const char **cleanup, bool *optimize) {
     cell *cell = termpaintp_getcell_or_null(surface, x, y);
     if (!cell || !cell->attr_patch_idx) {
@@ -1750,6 +2897,133 @@ bool termpaint_surface_peek_softwrap_marker(const termpaint_surface *surface, in
     return !!(cell->flags & CELL_SOFTWRAP_MARKER);
 }
 
+// Same as termpaint_surface_peek_text but for cells that are not wide right padding.
+static inline const unsigned char *termpaintp_cell_text(const cell *c, int *len) {
+    if (c->text_len > 0) {
+        *len = c->text_len;
+        return c->text;
+    } else if (c->text_overflow == nullptr) {
+        *len = 1;
+        return (const unsigned char*)TERMPAINT_ERASED;
+    } else {
+        *len = strlen((const char*)c->text_overflow->text);
+        return c->text_overflow->text;
+    }
+}
+
+static bool termpaintp_cell_same_patch(const termpaint_surface *surface1, const cell *cell1,
+                                       const termpaint_surface *surface2, const cell *cell2) {
+    if (!cell1->attr_patch_idx || !cell2->attr_patch_idx) {
+        return !cell1->attr_patch_idx && !cell2->attr_patch_idx;
+    }
+    if (surface1 == surface2) {
+        return cell1->attr_patch_idx == cell2->attr_patch_idx;
+    }
+    const termpaintp_patch *patch1 = &surface1->patches[cell1->attr_patch_idx - 1];
+    const termpaintp_patch *patch2 = &surface2->patches[cell2->attr_patch_idx - 1];
+    return patch1->optimize == patch2->optimize
+            && patch1->setup_hash == patch2->setup_hash
+            && patch1->cleanup_hash == patch2->cleanup_hash
+            && ustrcmp(patch1->setup, patch2->setup) == 0
+            && ustrcmp(patch1->cleanup, patch2->cleanup) == 0;
+}
+
+// Cells have to be compared left to right, wide right padding cells are only checked to be padding in both
+// surfaces, the text is compared via the start of the cluster.
+static bool termpaintp_cell_same_contents(const termpaint_surface *surface1, const cell *cell1,
+                                          const termpaint_surface *surface2, const cell *cell2) {
+    // Without patch, identical bytes imply same contents. Overflow text is interned per terminal, so equal
+    // pointers imply equal text.
+    if (cell1->attr_patch_idx == 0 && memcmp(cell1, cell2, sizeof(cell)) == 0) {
+        return true;
+    }
+
+    if (cell1->fg_color != cell2->fg_color
+            || cell1->bg_color != cell2->bg_color
+            || cell1->deco_color != cell2->deco_color
+            || cell1->flags != cell2->flags) {
+        return false;
+    }
+
+    if (!termpaintp_cell_same_patch(surface1, cell1, surface2, cell2)) {
+        return false;
+    }
+
+    bool padding1 = termpaintp_cell_is_wide_right_padding(cell1);
+    bool padding2 = termpaintp_cell_is_wide_right_padding(cell2);
+    if (padding1 || padding2) {
+        return padding1 == padding2;
+    }
+
+    if (cell1->cluster_expansion != cell2->cluster_expansion) {
+        return false;
+    }
+
+    int len1, len2;
+    const unsigned char *text1 = termpaintp_cell_text(cell1, &len1);
+    const unsigned char *text2 = termpaintp_cell_text(cell2, &len2);
+    return len1 == len2 && memcmp(text1, text2, len1) == 0;
+}
+
+static inline uint32_t termpaintp_hash_fnv1a_bytes(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = hash ^ p[i];
+        hash = hash * 16777619;
+    }
+    return hash;
+}
+
+static uint32_t termpaintp_surface_compute_row_hash(const termpaint_surface *surface, int y) {
+    // Needs to produce the same value for rows that termpaintp_cell_same_contents considers equal.
+    uint32_t hash = 2166136261;
+    const cell *row = surface->rows[y]->cells;
+    for (int x = 0; x < surface->width; x++) {
+        const cell *c = &row[x];
+        uint32_t header[5] = { c->fg_color, c->bg_color, c->deco_color, c->flags, 0 };
+        if (termpaintp_cell_is_wide_right_padding(c)) {
+            header[4] = 0xffffffff;
+        } else {
+            header[4] = c->cluster_expansion;
+        }
+        hash = termpaintp_hash_fnv1a_bytes(hash, header, sizeof(header));
+        if (!termpaintp_cell_is_wide_right_padding(c)) {
+            int len;
+            const unsigned char *text = termpaintp_cell_text(c, &len);
+            hash = termpaintp_hash_fnv1a_bytes(hash, text, len);
+            hash = termpaintp_hash_fnv1a_bytes(hash, "", 1);
+        }
+        if (c->attr_patch_idx) {
+            const termpaintp_patch *patch = &surface->patches[c->attr_patch_idx - 1];
+            uint32_t patch_data[3] = { patch->setup_hash, patch->cleanup_hash, patch->optimize };
+            hash = termpaintp_hash_fnv1a_bytes(hash, patch_data, sizeof(patch_data));
+        }
+    }
+    return hash;
+}
+
+unsigned termpaint_surface_row_hash(termpaint_surface *surface, int y) {
+    if (y < 0 || y >= surface->height) {
+        return 0;
+    }
+
+    if (!surface->row_hash_valid) {
+        surface->row_hashes = calloc(surface->height, sizeof(uint32_t));
+        surface->row_hash_valid = calloc(surface->height, sizeof(bool));
+        if (!surface->row_hashes || !surface->row_hash_valid) {
+            // just don't cache
+            termpaintp_surface_discard_row_hashes(surface);
+            return termpaintp_surface_compute_row_hash(surface, y);
+        }
+    }
+
+    if (!surface->row_hash_valid[y]) {
+        surface->row_hashes[y] = termpaintp_surface_compute_row_hash(surface, y);
+        surface->row_hash_valid[y] = true;
+    }
+    return surface->row_hashes[y];
+}
+
 bool termpaint_surface_same_contents(const termpaint_surface *surface1, const termpaint_surface *surface2) {
     if (surface1 == surface2) {
         return true;
@@ -1760,64 +3034,199 @@ bool termpaint_surface_same_contents(const termpaint_surface *surface1, const te
         return false;
     }
 
+    bool use_row_hashes = surface1->row_hash_valid && surface2->row_hash_valid;
+
     for (int y = 0; y < surface1->height; y++) {
+        if (use_row_hashes && surface1->row_hash_valid[y] && surface2->row_hash_valid[y]
+                && surface1->row_hashes[y] != surface2->row_hashes[y]) {
+            return false;
+        }
+        if (surface1->rows[y] == surface2->rows[y]) {
+            // shared row of a duplicated surface
+            continue;
+        }
+        const cell *row1 = surface1->rows[y]->cells;
+        const cell *row2 = surface2->rows[y]->cells;
         for (int x = 0; x < surface1->width; x++) {
-            if (termpaint_surface_peek_fg_color(surface1, x, y)
-                    != termpaint_surface_peek_fg_color(surface2, x, y)) {
+            if (!termpaintp_cell_same_contents(surface1, &row1[x], surface2, &row2[x])) {
                 return false;
             }
-            if (termpaint_surface_peek_bg_color(surface1, x, y)
-                    != termpaint_surface_peek_bg_color(surface2, x, y)) {
-                return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool termpaint_surface_diff(const termpaint_surface *surface1, const termpaint_surface *surface2,
+                            void (*changed)(void *user_data, int x, int y, int width), void *user_data) {
+    if (surface1->width != surface2->width
+      || surface1->height != surface2->height) {
+        return false;
+    }
+
+    if (surface1 == surface2) {
+        return true;
+    }
+
+    for (int y = 0; y < surface1->height; y++) {
+        if (surface1->rows[y] == surface2->rows[y]) {
+            // shared row of a duplicated surface
+            continue;
+        }
+        const cell *row1 = surface1->rows[y]->cells;
+        const cell *row2 = surface2->rows[y]->cells;
+
+        // pending span [span_start, span_end), span_end == -1 if none
+        int span_start = 0;
+        int span_end = -1;
+        int x = 0;
+        while (x < surface1->width) {
+            if (termpaintp_cell_same_contents(surface1, &row1[x], surface2, &row2[x])) {
+                x++;
+                continue;
             }
-            if (termpaint_surface_peek_deco_color(surface1, x, y)
-                    != termpaint_surface_peek_deco_color(surface2, x, y)) {
-                return false;
+            // extend to whole clusters in both surfaces
+            int start = x;
+            while (start > 0 && (termpaintp_cell_is_wide_right_padding(&row1[start])
+                                 || termpaintp_cell_is_wide_right_padding(&row2[start]))) {
+                start--;
             }
-            if (termpaint_surface_peek_style(surface1, x, y)
-                    != termpaint_surface_peek_style(surface2, x, y)) {
-                return false;
+            int end = x + 1;
+            while (end < surface1->width && (termpaintp_cell_is_wide_right_padding(&row1[end])
+                                             || termpaintp_cell_is_wide_right_padding(&row2[end]))) {
+                end++;
             }
-            if (termpaint_surface_peek_softwrap_marker(surface1, x, y)
-                    != termpaint_surface_peek_softwrap_marker(surface2, x, y)) {
-                return false;
+            if (span_end != -1 && start <= span_end) {
+                span_end = end;
+            } else {
+                if (span_end != -1) {
+                    changed(user_data, span_start, y, span_end - span_start);
+                }
+                span_start = start;
+                span_end = end;
             }
-            {
-                const char *setup1, *setup2;
-                const char *cleanup1, *cleanup2;
-                bool optimize1, optimize2;
-                termpaint_surface_peek_patch(surface1, x, y, &setup1, &cleanup1, &optimize1);
-                termpaint_surface_peek_patch(surface2, x, y, &setup2, &cleanup2, &optimize2);
+            x = end;
+        }
+        if (span_end != -1) {
+            changed(user_data, span_start, y, span_end - span_start);
+        }
+    }
 
-                if ((setup1 == nullptr || setup2 == nullptr || strcmp(setup1, setup2) != 0) && !(setup1 == nullptr && setup2 == nullptr)) {
-                    return false;
-                }
-                if ((cleanup1 == nullptr || cleanup2 == nullptr || strcmp(cleanup1, cleanup2) != 0) && !(setup1 == nullptr && setup2 == nullptr)) {
-                    return false;
-                }
-                if (optimize1 != optimize2) {
-                    return false;
-                }
+    return true;
+}
+
+void termpaint_surface_export_cells(const termpaint_surface *surface, int x, int y, int width, int height,
+                                   termpaint_cell_record *records) {
+    for (int y1 = 0; y1 < height; y1++) {
+        for (int x1 = 0; x1 < width; x1++) {
+            termpaint_cell_record *record = &records[y1 * width + x1];
+            const cell *c = termpaintp_getcell_or_null(surface, x + x1, y + y1);
+            if (!c) {
+                // same as the peek functions
+                record->text = TERMPAINT_ERASED;
+                record->text_len = 1;
+                record->width = 1;
+                record->fg_color = 0;
+                record->bg_color = 0;
+                record->deco_color = 0;
+                record->style = 0;
+                record->softwrap_marker = false;
+                record->patch_setup = nullptr;
+                record->patch_cleanup = nullptr;
+                record->patch_optimize = true;
+                continue;
             }
-            {
-                int left1, right1, len1;
-                int left2, right2, len2;
-                const char *text1 = termpaint_surface_peek_text(surface1, x, y, &len1, &left1, &right1);
-                const char *text2 = termpaint_surface_peek_text(surface2, x, y, &len2, &left2, &right2);
 
-                if (left1 != left2 || right1 != right2 || len1 != len2) {
-                    return false;
-                }
-                if (memcmp(text1, text2, len1) != 0) {
-                    return false;
-                }
+            if (termpaintp_cell_is_wide_right_padding(c)) {
+                record->text = "";
+                record->text_len = 0;
+                record->width = 0;
+            } else {
+                record->text = (const char*)termpaintp_cell_text(c, &record->text_len);
+                record->width = c->cluster_expansion + 1;
+            }
+            record->fg_color = c->fg_color;
+            record->bg_color = c->bg_color;
+            record->deco_color = c->deco_color;
+            record->style = termpaintp_flags_to_style(c->flags);
+            record->softwrap_marker = !!(c->flags & CELL_SOFTWRAP_MARKER);
+            if (c->attr_patch_idx) {
+                const termpaintp_patch *patch = &surface->patches[c->attr_patch_idx - 1];
+                record->patch_setup = (const char*)patch->setup;
+                record->patch_cleanup = (const char*)patch->cleanup;
+                record->patch_optimize = patch->optimize;
+            } else {
+                record->patch_setup = nullptr;
+                record->patch_cleanup = nullptr;
+                record->patch_optimize = true;
             }
         }
     }
+}
 
-    return true;
+static bool termpaintp_cell_record_same_attr(const termpaint_cell_record *a, const termpaint_cell_record *b) {
+    return a->fg_color == b->fg_color
+            && a->bg_color == b->bg_color
+            && a->deco_color == b->deco_color
+            && a->style == b->style
+            && a->patch_setup == b->patch_setup
+            && a->patch_cleanup == b->patch_cleanup
+            && a->patch_optimize == b->patch_optimize;
 }
 
+void termpaint_surface_import_cells(termpaint_surface *surface, int x, int y, int width, int height,
+                                   const termpaint_cell_record *records) {
+    // Consecutive records usually share attributes, so keep the last resolved attribute. A reference on its patch is
+    // held, so it stays valid while other patches are looked up.
+    const termpaint_cell_record *resolved_for = nullptr;
+    termpaintp_resolved_attr resolved;
+
+    for (int y1 = 0; y1 < height; y1++) {
+        // right most column already written by a cluster of the previous record
+        int covered_until = -1;
+        for (int x1 = 0; x1 < width; x1++) {
+            const termpaint_cell_record *record = &records[y1 * width + x1];
+            if (record->width == 0 && x1 <= covered_until) {
+                continue;
+            }
+
+            if (!resolved_for || !termpaintp_cell_record_same_attr(resolved_for, record)) {
+                if (resolved_for) {
+                    termpaintp_surface_patch_release(surface, resolved.patch_idx);
+                }
+                resolved.fg_color = record->fg_color;
+                resolved.bg_color = record->bg_color;
+                resolved.deco_color = record->deco_color;
+                resolved.flags = termpaintp_style_to_flags(record->style);
+                resolved.patch_idx = termpaintp_surface_ensure_patch_idx(surface, record->patch_optimize,
+                                                                         (unsigned char*)record->patch_setup,
+                                                                         (unsigned char*)record->patch_cleanup);
+                termpaintp_surface_patch_retain(surface, resolved.patch_idx);
+                resolved_for = record;
+            }
+
+            if (record->width == 0) {
+                // right part of a cluster that started outside of the imported area, fill like clipping would.
+                termpaintp_surface_write_resolved(surface, x + x1, y + y1, (const unsigned char*)" ", 1,
+                                                  &resolved, x + x1, x + width - 1, -1, nullptr);
+                covered_until = x1;
+            } else {
+                termpaintp_surface_write_resolved(surface, x + x1, y + y1, (const unsigned char*)record->text,
+                                                  record->text_len, &resolved, x + x1, x + width - 1,
+                                                  -1, nullptr);
+                covered_until = x1 + record->width - 1;
+            }
+            if (record->softwrap_marker) {
+                termpaint_surface_set_softwrap_marker(surface, x + x1, y + y1, true);
+            }
+        }
+    }
+
+    if (resolved_for) {
+        termpaintp_surface_patch_release(surface, resolved.patch_idx);
+    }
+}
 
 int termpaint_surface_char_width(const termpaint_surface *surface, int codepoint) {
     const termpaintp_width *char_width_table = surface->terminal->char_width_table;
@@ -2016,6 +3425,9 @@ termpaint_terminal *termpaint_terminal_new_or_nullptr(termpaint_integration *int
     ret->unpause_snippets.item_size = sizeof (termpaint_unpause_snippet);
     ret->unpause_snippets.destroy_cb = (void (*)(termpaint_hash_item*))termpaint_unpause_snippet_destroy;
 
+    ret->overflow_text.item_size = sizeof(termpaintp_overflow_text);
+    ret->overflow_text.gc_mark_cb = termpaintp_overflow_text_gc_mark_cb;
+
     if (!termpaintp_str_preallocate(&ret->unpause_basic_setup, 64)) {
         termpaint_input_free(ret->input);
         free(ret);
@@ -2097,6 +3509,15 @@ void termpaint_terminal_free(termpaint_terminal *term) {
     termpaintp_str_destroy(&term->unpause_basic_setup);
     termpaintp_hash_destroy(&term->colors);
     termpaintp_hash_destroy(&term->unpause_snippets);
+    termpaintp_hash_destroy(&term->overflow_text);
+    free(term->event_queue.events);
+    termpaintp_str_destroy(&term->event_queue.arena);
+    termpaintp_str_destroy(&term->event_queue.current_payload);
+    while (term->calibrated_widths) {
+        termpaintp_calibrated_width *next = term->calibrated_widths->next;
+        free(term->calibrated_widths);
+        term->calibrated_widths = next;
+    }
     free(term);
 }
 
@@ -2576,12 +3997,19 @@ static void termpaintp_terminal_flush_with_surface(termpaint_terminal *term, boo
                 needs_paint = true;
             }
 
+            if (surface->cells_last_flush) {
+                termpaintp_cell_text_release(old_c);
+                termpaintp_cell_text_retain(c);
+                termpaintp_cell_patch_release(surface, old_c);
+                termpaintp_cell_patch_retain(surface, c);
+            }
             *old_c = *c;
             old_c->bg_color = effective_bg_color;
             old_c->fg_color = effective_fg_color;
             if (surface->cells_last_flush) {
                 for (int i = 0; i < c->cluster_expansion; i++) {
                     cell* wipe_c = &surface->cells_last_flush[y*surface->width+x+i+1];
+                    termpaintp_cell_text_release(wipe_c);
                     wipe_c->text_len = 1;
                     wipe_c->text[0] = '\x01'; // impossible value, filtered out earlier in output pipeline
                 }
@@ -2979,10 +4407,11 @@ void termpaint_terminal_reset_color(termpaint_terminal *term, int color_slot) {
 }
 
 static bool termpaintp_terminal_auto_detect_event(termpaint_terminal *terminal, termpaint_event *event);
+static bool termpaintp_terminal_width_calibration_event(termpaint_terminal *terminal, termpaint_event *event);
 
 static bool termpaintp_input_raw_filter_callback(void *user_data, const char *data, unsigned length, _Bool overflow) {
     termpaint_terminal *term = user_data;
-    if (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED) {
+    if (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED || term->ad_state == AD_WIDTH_CALIBRATION) {
         if (term->raw_input_filter_cb) {
             return term->raw_input_filter_cb(term->raw_input_filter_user_data, data, length, overflow);
         } else {
@@ -3378,9 +4807,109 @@ void termpaint_terminal_auto_detect_apply_input_quirks(termpaint_terminal *termi
     }
 }
 
+// Returns a pointer to the string member of event or nullptr if the event does not contain a string that is only
+// valid while the event is processed. Atoms are not included as they stay valid.
+static const char **termpaintp_event_payload(termpaint_event *event, unsigned *length) {
+    switch (event->type) {
+        case TERMPAINT_EV_CHAR:
+        case TERMPAINT_EV_INVALID_UTF8:
+            *length = event->c.length;
+            return &event->c.string;
+        case TERMPAINT_EV_PASTE:
+            *length = event->paste.length;
+            return &event->paste.string;
+        case TERMPAINT_EV_TEXT:
+            *length = event->text.length;
+            return &event->text.string;
+        case TERMPAINT_EV_COLOR_SLOT_REPORT:
+            *length = event->color_slot_report.length;
+            return &event->color_slot_report.color;
+        case TERMPAINT_EV_PALETTE_COLOR_REPORT:
+            *length = event->palette_color_report.length;
+            return &event->palette_color_report.color_desc;
+        case TERMPAINT_EV_RAW_PRI_DEV_ATTRIB:
+        case TERMPAINT_EV_RAW_SEC_DEV_ATTRIB:
+        case TERMPAINT_EV_RAW_3RD_DEV_ATTRIB:
+        case TERMPAINT_EV_RAW_DECREQTPARM:
+        case TERMPAINT_EV_RAW_TERM_NAME:
+        case TERMPAINT_EV_RAW_TERMINFO_QUERY_REPLY:
+            *length = event->raw.length;
+            return &event->raw.string;
+    }
+    return nullptr;
+}
+
+static void termpaintp_event_queue_push(termpaintp_event_queue *queue, termpaint_event *event) {
+    if (queue->overflow) {
+        return;
+    }
+
+    termpaintp_queued_event *entry = &queue->events[(queue->head + queue->count) % queue->capacity];
+    ++queue->count;
+
+    if (queue->count == queue->capacity) {
+        // keep the last slot to tell the application that events were lost
+        queue->overflow = true;
+        entry->event.type = TERMPAINT_EV_OVERFLOW;
+        return;
+    }
+
+    entry->event = *event;
+    unsigned length;
+    const char **payload = termpaintp_event_payload(event, &length);
+    if (payload) {
+        termpaint_str *arena = &queue->arena;
+        if (arena->alloc <= arena->len + length) {
+            if (queue->arena_start) {
+                // move the strings of the remaining events to the start of the arena
+                unsigned start = queue->arena_start;
+                memmove(arena->data, arena->data + start, arena->len - start);
+                arena->len -= start;
+                queue->arena_start = 0;
+                for (int i = 0; i < queue->count - 1; i++) {
+                    termpaintp_queued_event *queued = &queue->events[(queue->head + i) % queue->capacity];
+                    unsigned queued_length;
+                    if (termpaintp_event_payload(&queued->event, &queued_length)) {
+                        queued->payload_offset -= start;
+                    }
+                }
+            }
+            // grow unless compacting freed at least half, so compacting stays amortized constant per byte
+            if (arena->alloc <= 2 * (arena->len + length)) {
+                unsigned new_size = arena->alloc * 2;
+                if (new_size < 2 * (arena->len + length)) {
+                    new_size = 2 * (arena->len + length);
+                }
+                termpaintp_str_realloc(arena, new_size);
+            }
+        }
+        entry->payload_offset = arena->len;
+        memcpy(arena->data + arena->len, *payload, length);
+        arena->len += length;
+    }
+}
+
+static void termpaintp_terminal_dispatch_event(termpaint_terminal *term, termpaint_event *event) {
+    if (term->event_queue.capacity) {
+        termpaintp_event_queue_push(&term->event_queue, event);
+    } else if (term->event_cb) {
+        term->event_cb(term->event_user_data, event);
+    }
+}
+
 static void termpaintp_input_event_callback(void *user_data, termpaint_event *event) {
     termpaint_terminal *term = user_data;
-    if (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED) {
+    if (term->ad_state == AD_WIDTH_CALIBRATION) {
+        if (termpaintp_terminal_width_calibration_event(term, event)) {
+            if (term->ad_state != AD_WIDTH_CALIBRATION) {
+                termpaint_event event;
+                event.type = TERMPAINT_EV_CHAR_WIDTHS_CALIBRATED;
+                termpaintp_terminal_dispatch_event(term, &event);
+            }
+            return;
+        }
+    }
+    if (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED || term->ad_state == AD_WIDTH_CALIBRATION) {
         if (event->type == TERMPAINT_EV_COLOR_SLOT_REPORT) {
             char buff[100];
             sprintf(buff, "%d", event->color_slot_report.slot);
@@ -3408,18 +4937,16 @@ static void termpaintp_input_event_callback(void *user_data, termpaint_event *ev
                 }
             }
         }
-        term->event_cb(term->event_user_data, event);
+        termpaintp_terminal_dispatch_event(term, event);
     } else {
         termpaintp_terminal_auto_detect_event(term, event);
         int_flush(term->integration);
         if (term->ad_state == AD_FINISHED) {
             termpaintp_auto_detect_init_terminal_version_and_caps(term);
 
-            if (term->event_cb) {
-                termpaint_event event;
-                event.type = TERMPAINT_EV_AUTO_DETECT_FINISHED;
-                term->event_cb(term->event_user_data, &event);
-            }
+            termpaint_event event;
+            event.type = TERMPAINT_EV_AUTO_DETECT_FINISHED;
+            termpaintp_terminal_dispatch_event(term, &event);
         }
     }
 }
@@ -3432,16 +4959,80 @@ void termpaint_terminal_callback(termpaint_terminal *term) {
         int_awaiting_response(integration);
         int_flush(integration);
     }
-}
+}
+
+void termpaint_terminal_set_raw_input_filter_cb(termpaint_terminal *term, bool (*cb)(void *, const char *, unsigned, bool), void *user_data) {
+    term->raw_input_filter_cb = cb;
+    term->raw_input_filter_user_data = user_data;
+}
+
+void termpaint_terminal_set_event_cb(termpaint_terminal *term, void (*cb)(void *, termpaint_event *), void *user_data) {
+    term->event_cb = cb;
+    term->event_user_data = user_data;
+}
+
+bool termpaint_terminal_set_event_queue_size_mustcheck(termpaint_terminal *term, int capacity) {
+    termpaintp_event_queue *queue = &term->event_queue;
+    termpaintp_queued_event *events = nullptr;
+    if (capacity < 0) {
+        BUG("termpaint_terminal_set_event_queue_size called with negative capacity");
+    }
+    if (capacity) {
+        if (capacity < 2) {
+            capacity = 2;
+        }
+        events = calloc((size_t)capacity, sizeof(termpaintp_queued_event));
+        if (!events) {
+            return false;
+        }
+    }
+
+    free(queue->events);
+    queue->events = events;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->overflow = false;
+    queue->arena.len = 0;
+    queue->arena_start = 0;
+    return true;
+}
+
+void termpaint_terminal_set_event_queue_size(termpaint_terminal *term, int capacity) {
+    if (!termpaint_terminal_set_event_queue_size_mustcheck(term, capacity)) {
+        termpaintp_oom(term);
+    }
+}
+
+termpaint_event *termpaint_terminal_next_event(termpaint_terminal *term) {
+    termpaintp_event_queue *queue = &term->event_queue;
+    if (!queue->count) {
+        return nullptr;
+    }
 
-void termpaint_terminal_set_raw_input_filter_cb(termpaint_terminal *term, bool (*cb)(void *, const char *, unsigned, bool), void *user_data) {
-    term->raw_input_filter_cb = cb;
-    term->raw_input_filter_user_data = user_data;
-}
+    termpaintp_queued_event *entry = &queue->events[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
 
-void termpaint_terminal_set_event_cb(termpaint_terminal *term, void (*cb)(void *, termpaint_event *), void *user_data) {
-    term->event_cb = cb;
-    term->event_user_data = user_data;
+    queue->current = entry->event;
+    if (queue->current.type == TERMPAINT_EV_OVERFLOW) {
+        queue->overflow = false;
+    }
+
+    unsigned length;
+    const char **payload = termpaintp_event_payload(&queue->current, &length);
+    if (payload) {
+        termpaintp_str_assign_n(&queue->current_payload, (const char*)queue->arena.data + entry->payload_offset, length);
+        *payload = (const char*)queue->current_payload.data;
+        queue->arena_start = entry->payload_offset + length;
+    }
+
+    if (!queue->count) {
+        queue->arena.len = 0;
+        queue->arena_start = 0;
+    }
+
+    return &queue->current;
 }
 
 void termpaint_terminal_add_input_data(termpaint_terminal *term, const char *data, unsigned length) {
@@ -3453,12 +5044,13 @@ void termpaint_terminal_add_input_data(termpaint_terminal *term, const char *dat
         int_debuglog_puts(term, "\n");
     }
     termpaint_input_add_data(term->input, data, length);
-    bool not_in_autodetect = (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED);
+    bool not_in_autodetect = (term->ad_state == AD_NONE || term->ad_state == AD_FINISHED
+                              || term->ad_state == AD_WIDTH_CALIBRATION);
 
     if (not_in_autodetect && term->request_repaint) {
         termpaint_event event;
         event.type = TERMPAINT_EV_REPAINT_REQUESTED;
-        term->event_cb(term->event_user_data, &event);
+        termpaintp_terminal_dispatch_event(term, &event);
         term->request_repaint = false;
     }
 
@@ -3498,6 +5090,14 @@ void termpaint_terminal_expect_apc_input_sequences(termpaint_terminal *term, boo
     termpaint_input_expect_apc_sequences(term->input, enabled);
 }
 
+void termpaint_terminal_batch_text_input(termpaint_terminal *term, bool enabled) {
+    termpaint_input_batch_text(term->input, enabled);
+}
+
+void termpaint_terminal_coalesce_mouse_motion(termpaint_terminal *term, bool enabled) {
+    termpaint_input_coalesce_mouse_motion(term->input, enabled);
+}
+
 void termpaint_terminal_activate_input_quirk(termpaint_terminal *term, int quirk) {
     termpaint_input_activate_quirk(term->input, quirk);
 }
@@ -3597,6 +5197,7 @@ static bool termpaintp_terminal_auto_detect_event(termpaint_terminal *terminal,
     switch (terminal->ad_state) {
         case AD_NONE:
         case AD_FINISHED:
+        case AD_WIDTH_CALIBRATION:
             // should not happen
             break;
         case AD_INITIAL:
@@ -4246,8 +5847,8 @@ static bool termpaintp_terminal_auto_detect_event(termpaint_terminal *terminal,
 }
 
 _Bool termpaint_terminal_auto_detect(termpaint_terminal *terminal) {
-    if (!terminal->event_cb) {
-        // bail out, running this without an event callback risks crashing
+    if (!terminal->event_cb && !terminal->event_queue.capacity) {
+        // bail out, running this without an event callback or queue risks crashing
         return false;
     }
 
@@ -4264,8 +5865,116 @@ _Bool termpaint_terminal_auto_detect(termpaint_terminal *terminal) {
     return true;
 }
 
+_Bool termpaint_terminal_calibrate_char_widths(termpaint_terminal *terminal) {
+    if ((!terminal->event_cb && !terminal->event_queue.capacity) || terminal->ad_state != AD_FINISHED) {
+        return false;
+    }
+    if (terminal->terminal_type == TT_INCOMPATIBLE || terminal->terminal_type == TT_TOODUMB
+            || terminal->terminal_type == TT_MISPARSING) {
+        return false;
+    }
+
+    termpaint_integration *integration = terminal->integration;
+
+    terminal->width_calibration_received = 0;
+    for (int i = 0; i < NUM_WIDTH_PROBES; i++) {
+        char buf[6];
+        int len = termpaintp_encode_to_utf8(termpaintp_width_probes[i].probe, (uchar*)buf);
+        int_puts(integration, "\r");
+        int_write(integration, buf, len);
+        if (termpaint_terminal_capable(terminal, TERMPAINT_CAPABILITY_SAFE_POSITION_REPORT)) {
+            int_puts(integration, "\033[?6n");
+        } else {
+            termpaint_input_expect_cursor_position_report(terminal->input);
+            int_puts(integration, "\033[6n");
+        }
+    }
+    int_puts(integration, "\r\033[K");
+    int_puts(integration, "\033[5n");
+    int_awaiting_response(integration);
+    int_flush(integration);
+    terminal->width_calibration_prev_state = terminal->ad_state;
+    terminal->ad_state = AD_WIDTH_CALIBRATION;
+    return true;
+}
+
+static int termpaintp_width_override_compare(const void *a, const void *b) {
+    const termpaintp_width_override *lhs = a;
+    const termpaintp_width_override *rhs = b;
+    return (lhs->first > rhs->first) - (lhs->first < rhs->first);
+}
+
+static void termpaintp_terminal_finish_width_calibration(termpaint_terminal *terminal) {
+    // compare against the static tables, so overrides from a previous calibration do not stick
+    termpaintp_width base = *terminal->char_width_table;
+    base.overrides = nullptr;
+    base.override_count = 0;
+
+    int count = 0;
+    for (int i = 0; i < terminal->width_calibration_received; i++) {
+        const termpaintp_width_probe *probe = &termpaintp_width_probes[i];
+        int measured = terminal->width_calibration_results[i];
+        if ((measured == 1 || measured == 2) && termpaintp_char_width(&base, probe->probe) != measured) {
+            count += probe->range_count;
+        }
+    }
+
+    if (count == 0 && terminal->char_width_table->override_count == 0) {
+        return;
+    }
+
+    termpaintp_calibrated_width *calibrated = calloc(1, sizeof(termpaintp_calibrated_width)
+                                                        + count * sizeof(termpaintp_width_override));
+    if (!calibrated) {
+        // keep the previous table
+        return;
+    }
+
+    int idx = 0;
+    for (int i = 0; i < terminal->width_calibration_received; i++) {
+        const termpaintp_width_probe *probe = &termpaintp_width_probes[i];
+        int measured = terminal->width_calibration_results[i];
+        if ((measured == 1 || measured == 2) && termpaintp_char_width(&base, probe->probe) != measured) {
+            for (int j = 0; j < probe->range_count; j++) {
+                calibrated->overrides[idx].first = probe->ranges[j].first;
+                calibrated->overrides[idx].last = probe->ranges[j].last;
+                calibrated->overrides[idx].width = measured;
+                ++idx;
+            }
+        }
+    }
+    qsort(calibrated->overrides, count, sizeof(termpaintp_width_override), termpaintp_width_override_compare);
+
+    calibrated->table = base;
+    calibrated->table.overrides = count ? calibrated->overrides : nullptr;
+    calibrated->table.override_count = count;
+    calibrated->next = terminal->calibrated_widths;
+    terminal->calibrated_widths = calibrated;
+    terminal->char_width_table = &calibrated->table;
+}
+
+static bool termpaintp_terminal_width_calibration_event(termpaint_terminal *terminal, termpaint_event *event) {
+    if (event->type == TERMPAINT_EV_CURSOR_POSITION) {
+        if (terminal->width_calibration_received < NUM_WIDTH_PROBES) {
+            terminal->width_calibration_results[terminal->width_calibration_received] = event->cursor_position.x;
+            ++terminal->width_calibration_received;
+            return true;
+        }
+    } else if (event->type == TERMPAINT_EV_MISC && event->misc.atom == termpaint_input_i_resync()) {
+        termpaintp_terminal_finish_width_calibration(terminal);
+        terminal->force_full_repaint = true;
+        terminal->ad_state = terminal->width_calibration_prev_state;
+        return true;
+    }
+    return false;
+}
+
 enum termpaint_auto_detect_state_enum termpaint_terminal_auto_detect_state(const termpaint_terminal *terminal) {
-    if (terminal->ad_state == AD_FINISHED) {
+    if (terminal->ad_state == AD_WIDTH_CALIBRATION) {
+        // calibration runs while the application is live, report the state it was started in
+        return terminal->width_calibration_prev_state == AD_NONE ? termpaint_auto_detect_none
+                                                                 : termpaint_auto_detect_done;
+    } else if (terminal->ad_state == AD_FINISHED) {
         return termpaint_auto_detect_done;
     } else if (terminal->ad_state == AD_NONE) {
         return termpaint_auto_detect_none;
@@ -4681,29 +6390,11 @@ void termpaint_attr_set_deco(termpaint_attr *attr, unsigned deco_color) {
 }
 
 void termpaint_attr_set_style(termpaint_attr *attr, int bits) {
-    attr->flags |= bits & TERMPAINT_STYLE_PASSTHROUGH;
-    if (bits & ~TERMPAINT_STYLE_PASSTHROUGH) {
-        if (bits & TERMPAINT_STYLE_UNDERLINE) {
-            attr->flags = (attr->flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_SINGLE;
-        } else if (bits & TERMPAINT_STYLE_UNDERLINE_DBL) {
-            attr->flags = (attr->flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_DOUBLE;
-        } else if (bits & TERMPAINT_STYLE_UNDERLINE_CURLY) {
-            attr->flags = (attr->flags & ~CELL_ATTR_UNDERLINE_MASK) | CELL_ATTR_UNDERLINE_CURLY;
-        }
-    }
+    attr->flags = termpaintp_flags_set_style(attr->flags, bits);
 }
 
 void termpaint_attr_unset_style(termpaint_attr *attr, int bits) {
-    attr->flags &= ~bits | ~TERMPAINT_STYLE_PASSTHROUGH;
-    if (bits & ~TERMPAINT_STYLE_PASSTHROUGH) {
-        if (bits & TERMPAINT_STYLE_UNDERLINE) {
-            attr->flags = attr->flags & ~CELL_ATTR_UNDERLINE_MASK;
-        } else if (bits & TERMPAINT_STYLE_UNDERLINE_DBL) {
-            attr->flags = attr->flags & ~CELL_ATTR_UNDERLINE_MASK;
-        } else if (bits & TERMPAINT_STYLE_UNDERLINE_CURLY) {
-            attr->flags = attr->flags & ~CELL_ATTR_UNDERLINE_MASK;
-        }
-    }
+    attr->flags = termpaintp_flags_unset_style(attr->flags, bits);
 }
 
 void termpaint_attr_reset_style(termpaint_attr *attr) {
@@ -4749,6 +6440,7 @@ termpaint_text_measurement *termpaint_text_measurement_new_or_nullptr(const term
         return nullptr;
     }
     m->terminal = surface->terminal;
+    m->cache = nullptr;
     termpaint_text_measurement_reset(m);
     return m;
 }
@@ -4761,11 +6453,14 @@ termpaint_text_measurement *termpaint_text_measurement_new(const termpaint_surfa
     return m;
 }
 
+static void termpaintp_measurement_cache_free(termpaintp_measurement_cache *cache);
+
 void termpaint_text_measurement_free(termpaint_text_measurement *m) {
     if (!m) {
         return;
     }
 
+    termpaintp_measurement_cache_free(m->cache);
     free(m);
 }
 
@@ -5023,20 +6718,342 @@ _Bool termpaint_text_measurement_feed_utf16(termpaint_text_measurement *m, const
     return false;
 }
 
+#define TERMPAINTP_MEASUREMENT_CACHE_MAX_LENGTH 4096
+
+static void termpaintp_measurement_cache_free(termpaintp_measurement_cache *cache) {
+    if (!cache) {
+        return;
+    }
+    termpaintp_measurement_cache_entry *entry = cache->lru_first;
+    while (entry) {
+        termpaintp_measurement_cache_entry *next = entry->lru_next;
+        free(entry->boundaries);
+        free(entry);
+        entry = next;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+_Bool termpaint_text_measurement_set_cache_size_mustcheck(termpaint_text_measurement *m, int entries) {
+    termpaintp_measurement_cache *cache = nullptr;
+    if (entries > 0) {
+        cache = calloc(1, sizeof(termpaintp_measurement_cache));
+        if (!cache) {
+            return false;
+        }
+        uint32_t buckets = 16;
+        while (buckets < (uint32_t)entries && buckets < (1u << 20)) {
+            buckets *= 2;
+        }
+        cache->buckets = calloc(buckets, sizeof(termpaintp_measurement_cache_entry*));
+        if (!cache->buckets) {
+            free(cache);
+            return false;
+        }
+        cache->bucket_mask = buckets - 1;
+        cache->max_entries = entries;
+    }
+    termpaintp_measurement_cache_free(m->cache);
+    m->cache = cache;
+    return true;
+}
+
+void termpaint_text_measurement_set_cache_size(termpaint_text_measurement *m, int entries) {
+    if (!termpaint_text_measurement_set_cache_size_mustcheck(m, entries)) {
+        termpaintp_oom(m->terminal);
+    }
+}
+
+unsigned long termpaint_text_measurement_cache_hits(const termpaint_text_measurement *m) {
+    return m->cache ? m->cache->hits : 0;
+}
+
+unsigned long termpaint_text_measurement_cache_misses(const termpaint_text_measurement *m) {
+    return m->cache ? m->cache->misses : 0;
+}
+
+static uint32_t termpaintp_measurement_cache_hash(const unsigned char *string, int len) {
+    uint32_t hash = 2166136261;
+    for (int i = 0; i < len; i++) {
+        hash = hash ^ string[i];
+        hash = hash * 16777619;
+    }
+    return hash;
+}
+
+static void termpaintp_measurement_cache_lru_unlink(termpaintp_measurement_cache *cache,
+                                                    termpaintp_measurement_cache_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_first = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_last = entry->lru_prev;
+    }
+}
+
+static void termpaintp_measurement_cache_lru_push_front(termpaintp_measurement_cache *cache,
+                                                        termpaintp_measurement_cache_entry *entry) {
+    entry->lru_prev = nullptr;
+    entry->lru_next = cache->lru_first;
+    if (cache->lru_first) {
+        cache->lru_first->lru_prev = entry;
+    } else {
+        cache->lru_last = entry;
+    }
+    cache->lru_first = entry;
+}
+
+static void termpaintp_measurement_cache_evict(termpaintp_measurement_cache *cache) {
+    termpaintp_measurement_cache_entry *victim = cache->lru_last;
+    termpaintp_measurement_cache_lru_unlink(cache, victim);
+    termpaintp_measurement_cache_entry **link = &cache->buckets[victim->hash & cache->bucket_mask];
+    while (*link != victim) {
+        link = &(*link)->bucket_next;
+    }
+    *link = victim->bucket_next;
+    free(victim->boundaries);
+    free(victim);
+    --cache->count;
+}
+
+// Measures the whole string without limits and records the position after each cluster. Feeding byte by byte
+// guarantees the same results as feeding the string in one go.
+static termpaintp_measurement_cache_entry *termpaintp_measurement_cache_create_entry(termpaint_terminal *terminal,
+                                                                                     const unsigned char *string,
+                                                                                     int len, uint32_t hash) {
+    termpaintp_measurement_cache_entry *entry = malloc(sizeof(termpaintp_measurement_cache_entry) + len);
+    if (!entry) {
+        return nullptr;
+    }
+    // there is at most one cluster per code unit
+    entry->boundaries = malloc((len ? len : 1) * sizeof(termpaintp_measurement_boundary));
+    if (!entry->boundaries) {
+        free(entry);
+        return nullptr;
+    }
+
+    termpaint_text_measurement scratch;
+    scratch.terminal = terminal;
+    scratch.cache = nullptr;
+    termpaint_text_measurement_reset(&scratch);
+
+    int count = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i < len) {
+            termpaint_text_measurement_feed_utf8(&scratch, (const char*)string + i, 1, false);
+        } else {
+            termpaint_text_measurement_feed_utf8(&scratch, "", 0, true);
+        }
+        // a new cluster commits the previous cluster and so does the end of the string
+        if (scratch.last_clusters > count) {
+            termpaintp_measurement_boundary *boundary = &entry->boundaries[count];
+            boundary->codepoints = scratch.last_codepoints;
+            boundary->width = scratch.last_width;
+            boundary->ref = scratch.last_ref;
+            ++count;
+        }
+    }
+
+    if (scratch.decoder_state != TMD_INITIAL) {
+        // incomplete utf8 sequence at the end, the measurement keeps decoder state that is not worth caching.
+        free(entry->boundaries);
+        free(entry);
+        return nullptr;
+    }
+
+    entry->hash = hash;
+    entry->char_width_table = terminal->char_width_table;
+    entry->final_state = scratch.state;
+    entry->cluster_count = count;
+    entry->len = len;
+    memcpy(entry->string, string, len);
+    return entry;
+}
+
+static termpaintp_measurement_cache_entry *termpaintp_measurement_cache_lookup(termpaint_text_measurement *m,
+                                                                               const unsigned char *string,
+                                                                               int len) {
+    termpaintp_measurement_cache *cache = m->cache;
+    const uint32_t hash = termpaintp_measurement_cache_hash(string, len);
+    termpaintp_measurement_cache_entry **bucket = &cache->buckets[hash & cache->bucket_mask];
+    for (termpaintp_measurement_cache_entry *entry = *bucket; entry; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->len == len && entry->char_width_table == m->terminal->char_width_table
+                && memcmp(entry->string, string, len) == 0) {
+            ++cache->hits;
+            termpaintp_measurement_cache_lru_unlink(cache, entry);
+            termpaintp_measurement_cache_lru_push_front(cache, entry);
+            return entry;
+        }
+    }
+
+    ++cache->misses;
+    termpaintp_measurement_cache_entry *entry = termpaintp_measurement_cache_create_entry(m->terminal, string, len,
+                                                                                         hash);
+    if (!entry) {
+        return nullptr;
+    }
+    if (cache->count == cache->max_entries) {
+        termpaintp_measurement_cache_evict(cache);
+    }
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    termpaintp_measurement_cache_lru_push_front(cache, entry);
+    ++cache->count;
+    return entry;
+}
+
+// Position after the first `clusters` clusters of the cached string.
+static void termpaintp_measurement_cache_position(const termpaintp_measurement_cache_entry *entry, int clusters,
+                                                  termpaintp_measurement_boundary *position) {
+    if (clusters == 0) {
+        position->codepoints = 0;
+        position->width = 0;
+        position->ref = 0;
+    } else {
+        *position = entry->boundaries[clusters - 1];
+    }
+}
+
+static void termpaintp_text_measurement_set_position(termpaint_text_measurement *m,
+                                                     const termpaintp_measurement_cache_entry *entry,
+                                                     int clusters) {
+    termpaintp_measurement_boundary position;
+    termpaintp_measurement_cache_position(entry, clusters, &position);
+    m->pending_codepoints = m->last_codepoints = position.codepoints;
+    m->pending_clusters = m->last_clusters = clusters;
+    m->pending_width = m->last_width = position.width;
+    m->pending_ref = m->last_ref = position.ref;
+}
+
+// Applies the cached measurement of a complete string to a measurement in initial state. This produces the same
+// results as feeding the string with final set: The limits are checked at the start of each cluster and at the end.
+static bool termpaintp_text_measurement_apply_cached(termpaint_text_measurement *m,
+                                                     const termpaintp_measurement_cache_entry *entry) {
+    // all counters are monotonic in the number of clusters, so search for the first position where a limit is
+    // reached or exceeded.
+    int lo = 0;
+    int hi = entry->cluster_count + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        termpaintp_text_measurement_set_position(m, entry, mid);
+        if (termpaintp_text_measurement_cmp_limits(m) >= 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (lo > entry->cluster_count) {
+        // no limit reached
+        termpaintp_text_measurement_set_position(m, entry, entry->cluster_count);
+        m->state = entry->final_state;
+        return false;
+    }
+
+    termpaintp_text_measurement_set_position(m, entry, lo);
+    if (termpaintp_text_measurement_cmp_limits(m) > 0) {
+        // some limit exceeded -> previous cluster is the best match
+        termpaintp_text_measurement_set_position(m, entry, lo - 1);
+        m->state = TM_IN_CLUSTER;
+    } else if (lo == entry->cluster_count) {
+        m->state = entry->final_state;
+    } else {
+        m->state = TM_IN_CLUSTER;
+    }
+    return true;
+}
+
+// Feeds up to n printable ASCII characters (each a cluster of width 1 made from one code unit) at once. Stops before
+// the character where a limit would be reached, that one needs to be fed using termpaint_text_measurement_feed_codepoint.
+// Returns the number of characters consumed.
+static int termpaintp_text_measurement_feed_ascii(termpaint_text_measurement *m, int n) {
+    if (termpaintp_text_measurement_cmp_limits(m) >= 0) {
+        return 0;
+    }
+    // All limits are above their pending values and each character increments all values by one.
+    if (m->limit_codepoints >= 0 && m->limit_codepoints - m->pending_codepoints < n) {
+        n = m->limit_codepoints - m->pending_codepoints;
+    }
+    if (m->limit_clusters >= 0 && m->limit_clusters - m->pending_clusters < n) {
+        n = m->limit_clusters - m->pending_clusters;
+    }
+    if (m->limit_width >= 0 && m->limit_width - m->pending_width < n) {
+        n = m->limit_width - m->pending_width;
+    }
+    if (m->limit_ref >= 0 && m->limit_ref - m->pending_ref < n) {
+        n = m->limit_ref - m->pending_ref;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    // same as n times: commit and add a single width cluster
+    m->last_codepoints = m->pending_codepoints + n - 1;
+    m->last_clusters = m->pending_clusters + n - 1;
+    m->last_width = m->pending_width + n - 1;
+    m->last_ref = m->pending_ref + n - 1;
+    m->pending_codepoints += n;
+    m->pending_clusters += n;
+    m->pending_width += n;
+    m->pending_ref += n;
+    m->state = TM_IN_CLUSTER;
+    return n;
+}
+
 _Bool termpaint_text_measurement_feed_utf8(termpaint_text_measurement *m, const char *code_units, int length, _Bool final) {
     if (m->decoder_state != TMD_INITIAL && m->decoder_state != TMD_PARTIAL_UTF8) {
         // This is bogus usage, but just paper over it
         m->decoder_state = TMD_INITIAL;
     }
 
+    if (m->cache && final && length > 0 && length <= TERMPAINTP_MEASUREMENT_CACHE_MAX_LENGTH && m->state == TM_INITIAL
+            && m->decoder_state == TMD_INITIAL && m->pending_codepoints == 0 && m->pending_clusters == 0
+            && m->pending_width == 0 && m->pending_ref == 0) {
+        // complete string measured from the start, use the cache
+        const termpaintp_measurement_cache_entry *entry
+                = termpaintp_measurement_cache_lookup(m, (const unsigned char*)code_units, length);
+        if (entry) {
+            return termpaintp_text_measurement_apply_cached(m, entry);
+        }
+    }
+
+    const unsigned char *units = (const unsigned char*)code_units;
+    // units before this index are known to consist of valid complete sequences
+    int validated_end = 0;
+
     for (int i = 0; i < length; i++) {
         int ch;
         int adjust = 1;
 
+        if (m->decoder_state == TMD_INITIAL && units[i] >= 0x20 && units[i] < 0x7f) {
+            int run = termpaintp_utf8_printable_ascii_prefix(units + i, length - i);
+            int consumed = termpaintp_text_measurement_feed_ascii(m, run);
+            if (consumed) {
+                i += consumed - 1;
+                continue;
+            }
+            // a limit is reached, let the regular path handle it.
+        }
+
         if (m->decoder_state == TMD_INITIAL) {
             int len = termpaintp_utf8_len(code_units[i]);
+            if (len > 1 && i >= validated_end) {
+                int chunk = length - i < TERMPAINTP_UTF8_VALIDATION_CHUNK
+                        ? length - i : TERMPAINTP_UTF8_VALIDATION_CHUNK;
+                validated_end = i + termpaintp_utf8_valid_prefix(units + i, chunk);
+            }
             if (len == 1) {
                 ch = code_units[i];
+            } else if (i + len <= validated_end) {
+                // decode complete sequence directly, without going through the partial sequence state
+                ch = termpaintp_utf8_decode_from_utf8(units + i, len);
+                adjust = len;
+                i += len - 1;
             } else {
                 m->decoder_state = TMD_PARTIAL_UTF8;
                 m->utf8_size = len;
@@ -5084,6 +7101,318 @@ _Bool termpaint_text_measurement_feed_utf8(termpaint_text_measurement *m, const
     return false;
 }
 
+typedef struct termpaintp_text_layout_ {
+    int width;
+    bool break_at_whitespace;
+    termpaint_text_line *lines;
+    int max_lines;
+    int line_count;
+
+    // line currently being filled
+    int line_start;
+    int line_width;
+    int line_clusters;
+
+    // run of spaces after the content of the current line, not yet known to be followed by more content that fits.
+    // space_start == -1 if none
+    int space_start;
+    int space_end;
+    int space_width;
+    int space_clusters;
+
+    // last run of spaces within the current line that can be used as break. break_length == -1 if none
+    int break_length;
+    int break_width;
+    int break_clusters;
+    int break_next;
+    int break_next_width;
+    int break_next_clusters;
+} termpaintp_text_layout;
+
+static void termpaintp_text_layout_emit(termpaintp_text_layout *layout, int length) {
+    if (layout->line_count < layout->max_lines) {
+        termpaint_text_line *line = &layout->lines[layout->line_count];
+        line->offset = layout->line_start;
+        line->length = length;
+        line->clusters = layout->line_clusters;
+        line->width = layout->line_width;
+    }
+    layout->line_count++;
+    layout->break_length = -1;
+}
+
+static void termpaintp_text_layout_add_cluster(termpaintp_text_layout *layout, int start, int end, int width,
+                                               bool lone_space) {
+    if (layout->break_at_whitespace && lone_space && layout->line_clusters > 0) {
+        if (layout->space_start == -1) {
+            layout->space_start = start;
+            layout->space_width = 0;
+            layout->space_clusters = 0;
+        }
+        layout->space_end = end;
+        layout->space_width += width;
+        layout->space_clusters += 1;
+        return;
+    }
+
+    while (layout->line_clusters > 0) {
+        const bool has_spaces = layout->space_start != -1;
+        const int space_width = has_spaces ? layout->space_width : 0;
+        if (layout->line_width + space_width + width <= layout->width) {
+            if (has_spaces) {
+                layout->break_length = layout->space_start - layout->line_start;
+                layout->break_width = layout->line_width;
+                layout->break_clusters = layout->line_clusters;
+                layout->break_next = layout->space_end;
+                layout->break_next_width = layout->line_width + layout->space_width;
+                layout->break_next_clusters = layout->line_clusters + layout->space_clusters;
+                layout->line_width += layout->space_width;
+                layout->line_clusters += layout->space_clusters;
+                layout->space_start = -1;
+            }
+            break;
+        }
+
+        if (has_spaces) {
+            // break at the spaces directly before this cluster
+            termpaintp_text_layout_emit(layout, layout->space_start - layout->line_start);
+            layout->space_start = -1;
+            layout->line_start = start;
+            layout->line_width = 0;
+            layout->line_clusters = 0;
+        } else if (layout->break_length != -1) {
+            // break at earlier spaces and move the clusters after them to the next line
+            const int next = layout->break_next;
+            const int carried_width = layout->line_width - layout->break_next_width;
+            const int carried_clusters = layout->line_clusters - layout->break_next_clusters;
+            layout->line_width = layout->break_width;
+            layout->line_clusters = layout->break_clusters;
+            termpaintp_text_layout_emit(layout, layout->break_length);
+            layout->line_start = next;
+            layout->line_width = carried_width;
+            layout->line_clusters = carried_clusters;
+        } else {
+            // break between clusters
+            termpaintp_text_layout_emit(layout, start - layout->line_start);
+            layout->line_start = start;
+            layout->line_width = 0;
+            layout->line_clusters = 0;
+        }
+    }
+
+    layout->line_width += width;
+    layout->line_clusters += 1;
+}
+
+int termpaint_text_layout_utf8(const termpaint_surface *surface, const char *string, int length, int width, int mode,
+                               termpaint_text_line *lines, int max_lines) {
+    const termpaintp_width *char_width_table = surface->terminal->char_width_table;
+    const unsigned char *units = (const unsigned char*)string;
+
+    termpaintp_text_layout layout;
+    layout.width = width < 1 ? 1 : width;
+    layout.break_at_whitespace = mode == TERMPAINT_TEXT_BREAK_WHITESPACE;
+    layout.lines = lines;
+    layout.max_lines = max_lines;
+    layout.line_count = 0;
+    layout.line_start = 0;
+    layout.line_width = 0;
+    layout.line_clusters = 0;
+    layout.space_start = -1;
+    layout.break_length = -1;
+
+    // Same cluster segmentation as termpaint_text_measurement_feed_codepoint, but a cluster is only passed on to
+    // layout once it is complete, because a space followed by a non spacing mark is no break opportunity.
+    int cluster_start = -1;
+    int cluster_width = 0;
+    bool cluster_lone_space = false;
+    bool initial = true;
+    // units before this index are known to consist of valid complete sequences
+    int validated_end = 0;
+
+    int i = 0;
+    while (i < length) {
+        int ch;
+        int size = termpaintp_utf8_len(units[i]);
+        if (size == 1) {
+            ch = units[i];
+        } else {
+            if (i >= validated_end) {
+                int chunk = length - i < TERMPAINTP_UTF8_VALIDATION_CHUNK
+                        ? length - i : TERMPAINTP_UTF8_VALIDATION_CHUNK;
+                validated_end = i + termpaintp_utf8_valid_prefix(units + i, chunk);
+            }
+            if (i + size <= validated_end) {
+                ch = termpaintp_utf8_decode_from_utf8(units + i, size);
+            } else if (i + size <= length && termpaintp_check_valid_sequence(units + i, size)) {
+                ch = termpaintp_utf8_decode_from_utf8(units + i, size);
+            } else {
+                // This is bogus usage, but just paper over it
+                ch = 0xFFFD;
+                if (i + size > length) {
+                    size = length - i;
+                }
+            }
+        }
+
+        int ch_width = termpaintp_char_width(char_width_table, replace_unusable_codepoints(ch));
+        if (ch_width == 0 && !initial) {
+            cluster_lone_space = false;
+        } else {
+            if (cluster_start != -1) {
+                termpaintp_text_layout_add_cluster(&layout, cluster_start, i, cluster_width, cluster_lone_space);
+            }
+            cluster_start = i;
+            // a non spacing mark at the start is measured with U+00a0 as base
+            cluster_width = ch_width ? ch_width : 1;
+            cluster_lone_space = ch == ' ';
+            // clear marker does not allow any modifiers
+            initial = ch == '\x7f';
+        }
+        i += size;
+    }
+    if (cluster_start != -1) {
+        termpaintp_text_layout_add_cluster(&layout, cluster_start, length, cluster_width, cluster_lone_space);
+    }
+
+    int line_end = length;
+    if (layout.space_start != -1) {
+        if (layout.line_width + layout.space_width <= layout.width) {
+            layout.line_width += layout.space_width;
+            layout.line_clusters += layout.space_clusters;
+        } else {
+            line_end = layout.space_start;
+        }
+    }
+    termpaintp_text_layout_emit(&layout, line_end - layout.line_start);
+
+    return layout.line_count;
+}
+
+// Splits text->input into clusters using char_width_table.
+static bool termpaintp_prepared_text_segment(termpaint_prepared_text *text, const termpaintp_width *char_width_table) {
+    const unsigned char *string = text->input;
+    const int len = text->input_len;
+
+    // Every cluster uses at least one input byte. The output of a cluster is at most 3 bytes per input byte plus
+    // U+00a0 as base and the terminating nul byte.
+    if (len > INT_MAX / 8) {
+        return false;
+    }
+    termpaintp_prepared_cluster *clusters = malloc((len + 1) * sizeof(termpaintp_prepared_cluster));
+    unsigned char *output = malloc(len * 6 + 1);
+    if (!clusters || !output) {
+        free(clusters);
+        free(output);
+        return false;
+    }
+
+    int cluster_count = 0;
+    int total_width = 0;
+    int output_used = 0;
+    int pos = 0;
+
+    const unsigned char *validated_end = string;
+    while (pos < len) {
+        unsigned char *cluster_utf8 = output + output_used;
+        int cluster_width;
+        int output_bytes_used;
+        int input_bytes_used = termpaintp_next_cluster(char_width_table, string + pos, len - pos, &validated_end,
+                                                       cluster_utf8, &cluster_width, &output_bytes_used);
+        if (input_bytes_used < 0) {
+            // like in write, the incomplete cluster is dropped
+            break;
+        }
+
+        cluster_utf8[output_bytes_used] = 0;
+        clusters[cluster_count].text_offset = output_used;
+        clusters[cluster_count].text_len = (uint8_t)output_bytes_used;
+        clusters[cluster_count].width = (uint8_t)cluster_width;
+        ++cluster_count;
+        output_used += output_bytes_used + 1;
+        total_width += cluster_width;
+        pos += input_bytes_used;
+    }
+
+    // shrinking can not really fail, but keep the larger allocation if it does.
+    unsigned char *shrunk_output = realloc(output, output_used ? output_used : 1);
+    if (shrunk_output) {
+        output = shrunk_output;
+    }
+    termpaintp_prepared_cluster *shrunk_clusters = realloc(clusters,
+                                                           (cluster_count ? cluster_count : 1) * sizeof(termpaintp_prepared_cluster));
+    if (shrunk_clusters) {
+        clusters = shrunk_clusters;
+    }
+
+    text->char_width_table = char_width_table;
+    text->width = total_width;
+    text->cluster_count = cluster_count;
+    text->clusters = clusters;
+    text->text = output;
+    return true;
+}
+
+static void termpaintp_prepared_text_release_segments(termpaint_prepared_text *text) {
+    free(text->clusters);
+    text->clusters = nullptr;
+    free(text->text);
+    text->text = nullptr;
+}
+
+termpaint_prepared_text *termpaint_prepared_text_new_or_nullptr(const termpaint_surface *surface, const char *string, int len) {
+    // Make sure to fail early when a nullptr is passed, as this function only copies the pointer.
+    if (!surface) {
+        BUG("termpaint_prepared_text_new called without valid surface");
+    }
+    if (len < 0) {
+        len = strlen(string);
+    }
+    termpaint_prepared_text *text = calloc(1, sizeof(termpaint_prepared_text));
+    if (!text) {
+        return nullptr;
+    }
+    text->input = malloc(len ? len : 1);
+    if (!text->input) {
+        free(text);
+        return nullptr;
+    }
+    memcpy(text->input, string, len);
+    text->input_len = len;
+    if (!termpaintp_prepared_text_segment(text, surface->terminal->char_width_table)) {
+        free(text->input);
+        free(text);
+        return nullptr;
+    }
+    return text;
+}
+
+termpaint_prepared_text *termpaint_prepared_text_new(const termpaint_surface *surface, const char *string, int len) {
+    termpaint_prepared_text *text = termpaint_prepared_text_new_or_nullptr(surface, string, len);
+    if (!text) {
+        termpaintp_oom(surface->terminal);
+    }
+    return text;
+}
+
+void termpaint_prepared_text_free(termpaint_prepared_text *text) {
+    if (!text) {
+        return;
+    }
+
+    termpaintp_prepared_text_release_segments(text);
+    free(text->input);
+    free(text);
+}
+
+int termpaint_prepared_text_width(const termpaint_prepared_text *text) {
+    return text->width;
+}
+
+int termpaint_prepared_text_clusters(const termpaint_prepared_text *text) {
+    return text->cluster_count;
+}
+
 bool termpaint_terminal_set_title_mustcheck(termpaint_terminal *term, const char *title, int mode) {
     if (mode != TERMPAINT_TITLE_MODE_PREFER_RESTORE) {
         if (!termpaint_terminal_capable(term, TERMPAINT_CAPABILITY_TITLE_RESTORE)) {
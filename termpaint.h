@@ -25,6 +25,9 @@ typedef struct termpaint_attr_ termpaint_attr;
 struct termpaint_text_measurement_;
 typedef struct termpaint_text_measurement_ termpaint_text_measurement;
 
+struct termpaint_prepared_text_;
+typedef struct termpaint_prepared_text_ termpaint_prepared_text;
+
 struct termpaint_surface_;
 typedef struct termpaint_surface_ termpaint_surface;
 
@@ -109,6 +112,9 @@ _tERMPAINT_PUBLIC _Bool termpaint_terminal_request_tagged_paste_mustcheck(termpa
 _tERMPAINT_PUBLIC void termpaint_terminal_callback(termpaint_terminal *term);
 _tERMPAINT_PUBLIC void termpaint_terminal_set_raw_input_filter_cb(termpaint_terminal *term, _Bool (*cb)(void *user_data, const char *data, unsigned length, _Bool overflow), void *user_data);
 _tERMPAINT_PUBLIC void termpaint_terminal_set_event_cb(termpaint_terminal *term, void (*cb)(void *user_data, termpaint_event* event), void *user_data);
+_tERMPAINT_PUBLIC void termpaint_terminal_set_event_queue_size(termpaint_terminal *term, int capacity);
+_tERMPAINT_PUBLIC _Bool termpaint_terminal_set_event_queue_size_mustcheck(termpaint_terminal *term, int capacity);
+_tERMPAINT_PUBLIC termpaint_event *termpaint_terminal_next_event(termpaint_terminal *term);
 _tERMPAINT_PUBLIC void termpaint_terminal_add_input_data(termpaint_terminal *term, const char *data, unsigned length);
 _tERMPAINT_PUBLIC const char* termpaint_terminal_peek_input_buffer(const termpaint_terminal *term);
 _tERMPAINT_PUBLIC int termpaint_terminal_peek_input_buffer_length(const termpaint_terminal *term);
@@ -118,6 +124,8 @@ _tERMPAINT_PUBLIC void termpaint_terminal_expect_cursor_position_report(termpain
 _tERMPAINT_PUBLIC void termpaint_terminal_expect_legacy_mouse_reports(termpaint_terminal *term, int s);
 _tERMPAINT_PUBLIC void termpaint_terminal_handle_paste(termpaint_terminal *term, _Bool enabled);
 _tERMPAINT_PUBLIC void termpaint_terminal_expect_apc_input_sequences(termpaint_terminal *term, _Bool enabled);
+_tERMPAINT_PUBLIC void termpaint_terminal_batch_text_input(termpaint_terminal *term, _Bool enabled);
+_tERMPAINT_PUBLIC void termpaint_terminal_coalesce_mouse_motion(termpaint_terminal *term, _Bool enabled);
 _tERMPAINT_PUBLIC void termpaint_terminal_activate_input_quirk(termpaint_terminal *term, int quirk);
 
 _tERMPAINT_PUBLIC _Bool termpaint_terminal_auto_detect(termpaint_terminal *terminal);
@@ -125,6 +133,7 @@ enum termpaint_auto_detect_state_enum { termpaint_auto_detect_none,
                                                  termpaint_auto_detect_running,
                                                  termpaint_auto_detect_done };
 _tERMPAINT_PUBLIC enum termpaint_auto_detect_state_enum termpaint_terminal_auto_detect_state(const termpaint_terminal *terminal);
+_tERMPAINT_PUBLIC _Bool termpaint_terminal_calibrate_char_widths(termpaint_terminal *terminal);
 _tERMPAINT_PUBLIC _Bool termpaint_terminal_might_be_supported(const termpaint_terminal *terminal);
 _tERMPAINT_PUBLIC void termpaint_terminal_auto_detect_apply_input_quirks(termpaint_terminal *terminal, _Bool backspace_is_x08);
 _tERMPAINT_PUBLIC void termpaint_terminal_auto_detect_result_text(const termpaint_terminal *terminal, char *buffer, int buffer_length);
@@ -217,6 +226,8 @@ _tERMPAINT_PUBLIC void termpaint_attr_reset_style(termpaint_attr* attr);
 
 _tERMPAINT_PUBLIC termpaint_surface *termpaint_terminal_new_surface(termpaint_terminal *term, int width, int height);
 _tERMPAINT_PUBLIC termpaint_surface *termpaint_terminal_new_surface_or_nullptr(termpaint_terminal *term, int width, int height);
+_tERMPAINT_PUBLIC termpaint_surface *termpaint_terminal_new_worker_surface(termpaint_terminal *term, int width, int height);
+_tERMPAINT_PUBLIC termpaint_surface *termpaint_terminal_new_worker_surface_or_nullptr(termpaint_terminal *term, int width, int height);
 _tERMPAINT_PUBLIC termpaint_surface *termpaint_surface_new_surface(termpaint_surface *surface, int width, int height);
 _tERMPAINT_PUBLIC termpaint_surface *termpaint_surface_new_surface_or_nullptr(termpaint_surface *surface, int width, int height);
 _tERMPAINT_PUBLIC termpaint_surface *termpaint_surface_duplicate(termpaint_surface *surface);
@@ -234,6 +245,32 @@ _tERMPAINT_PUBLIC void termpaint_surface_write_with_attr(termpaint_surface *surf
 _tERMPAINT_PUBLIC void termpaint_surface_write_with_len_attr(termpaint_surface *surface, int x, int y, const char *string, int len, const termpaint_attr *attr);
 _tERMPAINT_PUBLIC void termpaint_surface_write_with_attr_clipped(termpaint_surface *surface, int x, int y, const char *string, const termpaint_attr *attr, int clip_x0, int clip_x1);
 _tERMPAINT_PUBLIC void termpaint_surface_write_with_len_attr_clipped(termpaint_surface *surface, int x, int y, const char *string, int len, const termpaint_attr *attr, int clip_x0, int clip_x1);
+
+typedef struct termpaint_write_span_ {
+    int x;
+    int y;
+    const char *string;
+    int len;
+    const termpaint_attr *attr;
+    int clip_x0;
+    int clip_x1;
+} termpaint_write_span;
+
+_tERMPAINT_PUBLIC void termpaint_surface_write_spans(termpaint_surface *surface, const termpaint_write_span *spans, int count);
+
+typedef struct termpaint_write_result_ {
+    int end_x;
+    int bytes;
+    int clusters;
+    _Bool truncated;
+} termpaint_write_result;
+
+_tERMPAINT_PUBLIC void termpaint_surface_write_measured_with_colors(termpaint_surface *surface, int x, int y, const char *string, int len, int fg, int bg, int max_width, const char *ellipsis, termpaint_write_result *result);
+_tERMPAINT_PUBLIC void termpaint_surface_write_measured_with_attr(termpaint_surface *surface, int x, int y, const char *string, int len, const termpaint_attr *attr, int max_width, const char *ellipsis, termpaint_write_result *result);
+
+_tERMPAINT_PUBLIC int termpaint_surface_write_prepared_with_colors(termpaint_surface *surface, int x, int y, termpaint_prepared_text *text, int fg, int bg, int max_width);
+_tERMPAINT_PUBLIC int termpaint_surface_write_prepared_with_attr(termpaint_surface *surface, int x, int y, termpaint_prepared_text *text, const termpaint_attr *attr, int max_width);
+
 _tERMPAINT_PUBLIC void termpaint_surface_clear(termpaint_surface *surface, int fg, int bg);
 _tERMPAINT_PUBLIC void termpaint_surface_clear_with_char(termpaint_surface *surface, int fg, int bg, int codepoint);
 _tERMPAINT_PUBLIC void termpaint_surface_clear_with_attr(termpaint_surface *surface, const termpaint_attr *attr);
@@ -246,6 +283,11 @@ _tERMPAINT_PUBLIC void termpaint_surface_clear_rect_with_attr_char(termpaint_sur
 _tERMPAINT_PUBLIC void termpaint_surface_set_fg_color(const termpaint_surface *surface, int x, int y, unsigned fg);
 _tERMPAINT_PUBLIC void termpaint_surface_set_bg_color(const termpaint_surface *surface, int x, int y, unsigned bg);
 _tERMPAINT_PUBLIC void termpaint_surface_set_deco_color(const termpaint_surface *surface, int x, int y, unsigned deco_color);
+_tERMPAINT_PUBLIC void termpaint_surface_set_fg_color_rect(termpaint_surface *surface, int x, int y, int width, int height, unsigned fg);
+_tERMPAINT_PUBLIC void termpaint_surface_set_bg_color_rect(termpaint_surface *surface, int x, int y, int width, int height, unsigned bg);
+_tERMPAINT_PUBLIC void termpaint_surface_set_deco_color_rect(termpaint_surface *surface, int x, int y, int width, int height, unsigned deco_color);
+_tERMPAINT_PUBLIC void termpaint_surface_set_style_rect(termpaint_surface *surface, int x, int y, int width, int height, int bits);
+_tERMPAINT_PUBLIC void termpaint_surface_unset_style_rect(termpaint_surface *surface, int x, int y, int width, int height, int bits);
 
 _tERMPAINT_PUBLIC void termpaint_surface_set_softwrap_marker(termpaint_surface *surface, int x, int y, _Bool state);
 #define TERMPAINT_COPY_NO_TILE 0
@@ -257,6 +299,24 @@ _tERMPAINT_PUBLIC void termpaint_surface_copy_rect(termpaint_surface *src_surfac
 _tERMPAINT_PUBLIC void termpaint_surface_tint(termpaint_surface *surface,
                             void (*recolor)(void *user_data, unsigned *fg, unsigned *bg, unsigned *deco),
                             void *user_data);
+_tERMPAINT_PUBLIC void termpaint_surface_tint_rect(termpaint_surface *surface, int x, int y, int width, int height,
+                            void (*recolor)(void *user_data, unsigned *fg, unsigned *bg, unsigned *deco),
+                            void *user_data);
+
+typedef struct termpaint_color_transform_ {
+    unsigned fg_default;
+    unsigned bg_default;
+    unsigned deco_default;
+    unsigned named[16];
+    unsigned indexed[256];
+    unsigned rgb_target;
+    int rgb_alpha;
+} termpaint_color_transform;
+
+_tERMPAINT_PUBLIC void termpaint_color_transform_init(termpaint_color_transform *transform);
+_tERMPAINT_PUBLIC void termpaint_surface_tint_transform(termpaint_surface *surface, const termpaint_color_transform *transform);
+_tERMPAINT_PUBLIC void termpaint_surface_tint_rect_transform(termpaint_surface *surface, int x, int y, int width, int height,
+                            const termpaint_color_transform *transform);
 
 _tERMPAINT_PUBLIC unsigned termpaint_surface_peek_fg_color(const termpaint_surface *surface, int x, int y);
 _tERMPAINT_PUBLIC unsigned termpaint_surface_peek_bg_color(const termpaint_surface *surface, int x, int y);
@@ -266,12 +326,37 @@ _tERMPAINT_PUBLIC void termpaint_surface_peek_patch(const termpaint_surface *sur
 _tERMPAINT_PUBLIC const char *termpaint_surface_peek_text(const termpaint_surface *surface, int x, int y, int *len, int *left, int *right);
 _tERMPAINT_PUBLIC _Bool termpaint_surface_peek_softwrap_marker(const termpaint_surface *surface, int x, int y);
 _tERMPAINT_PUBLIC _Bool termpaint_surface_same_contents(const termpaint_surface *surface1, const termpaint_surface *surface2);
+_tERMPAINT_PUBLIC _Bool termpaint_surface_diff(const termpaint_surface *surface1, const termpaint_surface *surface2,
+                            void (*changed)(void *user_data, int x, int y, int width), void *user_data);
+_tERMPAINT_PUBLIC unsigned termpaint_surface_row_hash(termpaint_surface *surface, int y);
+
+typedef struct termpaint_cell_record_ {
+    const char *text;
+    int text_len;
+    int width;
+    unsigned fg_color;
+    unsigned bg_color;
+    unsigned deco_color;
+    int style;
+    _Bool softwrap_marker;
+    _Bool patch_optimize;
+    const char *patch_setup;
+    const char *patch_cleanup;
+} termpaint_cell_record;
+
+_tERMPAINT_PUBLIC void termpaint_surface_export_cells(const termpaint_surface *surface, int x, int y, int width, int height, termpaint_cell_record *records);
+_tERMPAINT_PUBLIC void termpaint_surface_import_cells(termpaint_surface *surface, int x, int y, int width, int height, const termpaint_cell_record *records);
 
 _tERMPAINT_PUBLIC termpaint_text_measurement* termpaint_text_measurement_new(const termpaint_surface *surface);
 _tERMPAINT_PUBLIC termpaint_text_measurement* termpaint_text_measurement_new_or_nullptr(const termpaint_surface *surface);
 _tERMPAINT_PUBLIC void termpaint_text_measurement_free(termpaint_text_measurement *m);
 _tERMPAINT_PUBLIC void termpaint_text_measurement_reset(termpaint_text_measurement *m);
 
+_tERMPAINT_PUBLIC void termpaint_text_measurement_set_cache_size(termpaint_text_measurement *m, int entries);
+_tERMPAINT_PUBLIC _Bool termpaint_text_measurement_set_cache_size_mustcheck(termpaint_text_measurement *m, int entries);
+_tERMPAINT_PUBLIC unsigned long termpaint_text_measurement_cache_hits(const termpaint_text_measurement *m);
+_tERMPAINT_PUBLIC unsigned long termpaint_text_measurement_cache_misses(const termpaint_text_measurement *m);
+
 _tERMPAINT_PUBLIC int termpaint_text_measurement_pending_ref(const termpaint_text_measurement *m);
 
 _tERMPAINT_PUBLIC int termpaint_text_measurement_last_codepoints(const termpaint_text_measurement *m);
@@ -296,6 +381,24 @@ _tERMPAINT_PUBLIC _Bool /* reached limit */ termpaint_text_measurement_feed_utf3
 _tERMPAINT_PUBLIC _Bool /* reached limit */ termpaint_text_measurement_feed_utf16(termpaint_text_measurement *m, const uint16_t *code_units, int length, _Bool final);
 _tERMPAINT_PUBLIC _Bool /* reached limit */ termpaint_text_measurement_feed_utf8(termpaint_text_measurement *m, const char *code_units, int length, _Bool final);
 
+typedef struct termpaint_text_line_ {
+    int offset;
+    int length;
+    int clusters;
+    int width;
+} termpaint_text_line;
+
+#define TERMPAINT_TEXT_BREAK_CLUSTERS 0
+#define TERMPAINT_TEXT_BREAK_WHITESPACE 1
+
+_tERMPAINT_PUBLIC int termpaint_text_layout_utf8(const termpaint_surface *surface, const char *string, int length, int width, int mode, termpaint_text_line *lines, int max_lines);
+
+_tERMPAINT_PUBLIC termpaint_prepared_text* termpaint_prepared_text_new(const termpaint_surface *surface, const char *string, int len);
+_tERMPAINT_PUBLIC termpaint_prepared_text* termpaint_prepared_text_new_or_nullptr(const termpaint_surface *surface, const char *string, int len);
+_tERMPAINT_PUBLIC void termpaint_prepared_text_free(termpaint_prepared_text *text);
+_tERMPAINT_PUBLIC int termpaint_prepared_text_width(const termpaint_prepared_text *text);
+_tERMPAINT_PUBLIC int termpaint_prepared_text_clusters(const termpaint_prepared_text *text);
+
 #ifdef __cplusplus
 }
 #endif
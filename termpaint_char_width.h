@@ -1,74 +1,76 @@
 // SPDX-License-Identifier: BSL-1.0
-#define NEW_WIDTH(num, width) ((num << 2) | (((unsigned)width) & 3))
 
-#include "charclassification.inc"
-#include "charclassification_konsole_2018.inc"
-#include "charclassification_konsole_2022.inc"
+// generated by charwidthtables.py from charclassification*.inc
+#include "charwidth_tables.inc"
 
-#undef NEW_WIDTH
+// Inclusive range of codepoints with a width that differs from the lookup tables, see
+// termpaint_terminal_calibrate_char_widths.
+typedef struct termpaintp_width_override_ {
+    int first;
+    int last;
+    int width;
+} termpaintp_width_override;
 
 typedef struct termpaintp_width_ {
-    const uint16_t* termpaint_char_width_offsets;
-    const uint16_t* termpaint_char_width_data;
+    const int8_t* termpaint_char_width_latin1;
+    const uint8_t* termpaint_char_width_stage1;
+    const uint8_t* termpaint_char_width_stage2;
+    // sorted by first, non overlapping. Only used for codepoints >= 256.
+    const termpaintp_width_override *overrides;
+    int override_count;
 } termpaintp_width;
 
 static const termpaintp_width termpaintp_char_width_default = {
-    .termpaint_char_width_offsets = termpaint_char_width_offsets_default,
-    .termpaint_char_width_data = termpaint_char_width_data_default
+    .termpaint_char_width_latin1 = termpaint_char_width_latin1_default,
+    .termpaint_char_width_stage1 = termpaint_char_width_stage1_default,
+    .termpaint_char_width_stage2 = termpaint_char_width_stage2_default
 };
 
 static const termpaintp_width termpaintp_char_width_konsole2018 = {
-    .termpaint_char_width_offsets = termpaint_char_width_offsets_konsole_2018,
-    .termpaint_char_width_data = termpaint_char_width_data_konsole_2018
+    .termpaint_char_width_latin1 = termpaint_char_width_latin1_konsole_2018,
+    .termpaint_char_width_stage1 = termpaint_char_width_stage1_konsole_2018,
+    .termpaint_char_width_stage2 = termpaint_char_width_stage2_konsole_2018
 };
 
 static const termpaintp_width termpaintp_char_width_konsole2022 = {
-    .termpaint_char_width_offsets = termpaint_char_width_offsets_konsole_2022,
-    .termpaint_char_width_data = termpaint_char_width_data_konsole_2022
+    .termpaint_char_width_latin1 = termpaint_char_width_latin1_konsole_2022,
+    .termpaint_char_width_stage1 = termpaint_char_width_stage1_konsole_2022,
+    .termpaint_char_width_stage2 = termpaint_char_width_stage2_konsole_2022
 };
 
-static int termpaintp_char_width(const termpaintp_width *table, int ch) {
-    if (ch >= 0x10ffff) {
+static inline int termpaintp_char_width(const termpaintp_width *table, int ch) {
+    if ((unsigned)ch < 256) {
+        return table->termpaint_char_width_latin1[ch];
+    }
+
+    if (ch >= 0x10ffff || ch < 0) {
         // outside of unicode, assume narrow
         return 1;
     }
 
-    const uint16_t* termpaint_char_width_offsets = table->termpaint_char_width_offsets;
-    const uint16_t* termpaint_char_width_data = table->termpaint_char_width_data;
-
-    int low = termpaint_char_width_offsets[ch >> 14];
-    int high = termpaint_char_width_offsets[(ch >> 14) + 1] - 1;
-
-    int search = (ch & 0x3fff) << 2;
-
-    while (1) {
-        if (low == high) {
-            if ((termpaint_char_width_data[low] & 0xfffc) > search) {
-                // this is save as each section always starts with data for 0
-                --low;
-            }
-            int val = termpaint_char_width_data[low] & 3;
-            if (val == 3) {
-                return -1;
-            }
-            return val;
-        }
-
-        int mid = low + (high - low) / 2;
-
-        if (termpaint_char_width_data[mid] < search) {
-            low = mid + 1;
-        } else {
-            if ((termpaint_char_width_data[mid] & 0xfffc) == search) {
-                int val = termpaint_char_width_data[mid] & 3;
-                if (val == 3) {
-                    return -1;
-                }
-                return val;
+    if (table->override_count) {
+        int lo = 0;
+        int hi = table->override_count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (table->overrides[mid].last < ch) {
+                lo = mid + 1;
             } else {
-                high = mid;
+                hi = mid;
             }
         }
+        if (lo < table->override_count && table->overrides[lo].first <= ch) {
+            return table->overrides[lo].width;
+        }
+    }
 
+    // stage1 maps blocks of 256 codepoints to (deduplicated) blocks in stage2.
+    // stage2 has 2 bits per codepoint, 3 means -1.
+    unsigned block = table->termpaint_char_width_stage1[ch >> 8];
+    unsigned packed = table->termpaint_char_width_stage2[block * 64 + ((ch & 0xff) >> 2)];
+    int val = (packed >> ((ch & 3) * 2)) & 3;
+    if (val == 3) {
+        return -1;
     }
+    return val;
 }
@@ -86,6 +86,8 @@ _tERMPAINT_PUBLIC const char *termpaint_input_paste_end(void);
 #define TERMPAINT_EV_MISC 11
 #define TERMPAINT_EV_PALETTE_COLOR_REPORT 12
 #define TERMPAINT_EV_PASTE 13
+#define TERMPAINT_EV_CHAR_WIDTHS_CALIBRATED 14
+#define TERMPAINT_EV_TEXT 15
 
 #define TERMPAINT_EV_RAW_PRI_DEV_ATTRIB 100
 #define TERMPAINT_EV_RAW_SEC_DEV_ATTRIB 101
@@ -128,6 +130,12 @@ struct termpaint_event_ {
             _Bool final;
         } paste;
 
+        // EV_TEXT
+        struct {
+            unsigned length;
+            const char *string;
+        } text;
+
         // EV_MOUSE
         struct {
             int x;
@@ -136,6 +144,7 @@ struct termpaint_event_ {
             int action; // TERMPAINT_MOUSE_*
             int button; // button == 3 means release with unknown button
             int modifier;
+            int coalesced; // number of motion events merged into this one
         } mouse;
 
         // EV_MISC
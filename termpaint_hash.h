@@ -124,7 +124,7 @@ static void* termpaintp_hash_ensure(termpaint_hash* p, const unsigned char* text
             item = item->next;
         }
         if (p->allocated / 2 <= p->count) {
-            if (termpaintp_hash_gc(p) == 0) {
+            if (termpaintp_hash_gc(p) < p->allocated / 8) {
                 if (!termpaintp_hash_grow(p)) {
                     return NULL;
                 }
@@ -146,7 +146,7 @@ static void* termpaintp_hash_ensure(termpaint_hash* p, const unsigned char* text
             return item;
         }
     } else {
-        if (p->allocated / 2 <= p->count && termpaintp_hash_gc(p) == 0) {
+        if (p->allocated / 2 <= p->count && termpaintp_hash_gc(p) < p->allocated / 8) {
             if (!termpaintp_hash_grow(p)) {
                 return NULL;
             }
@@ -5,7 +5,6 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdlib.h> // for exit
 #include <stdio.h> // for debugging prints and debugging data export
 
 #include "termpaint_compiler.h"
@@ -641,23 +640,38 @@ static const key_mapping_entry key_mapping_table[] = {
     { 0, 0, 0 }
 };
 
+// Open addressing hash index into key_mapping_table, slots are found by fnv1a hash of the sequence and linear probing.
+// The generator also rejects duplicate sequences.
+typedef struct key_mapping_index_slot_ {
+    uint16_t entry;
+    uint8_t length;
+} key_mapping_index_slot;
 
-void termpaintp_input_selfcheck(void) {
-    static bool finished;
-    if (finished) return;
-    bool ok = true;
-    for (const key_mapping_entry* entry_a = key_mapping_table; entry_a->sequence != nullptr; entry_a++) {
-        for (const key_mapping_entry* entry_b = entry_a; entry_b->sequence != nullptr; entry_b++) {
-            if (entry_a != entry_b && strcmp(entry_a->sequence, entry_b->sequence) == 0) {
-                printf("Duplicate key mapping: %s == %s\n", entry_a->atom, entry_b->atom);
-                ok = false;
-            }
-        }
+#define KEY_MAPPING_INDEX_EMPTY 0xffff
+
+// generated by keymappingtable.py from key_mapping_table
+#include "key_mapping_index.inc"
+
+_Static_assert(sizeof(key_mapping_table) / sizeof(key_mapping_table[0]) == KEY_MAPPING_TABLE_ENTRIES + 1,
+               "key_mapping_index.inc out of date");
+
+static const key_mapping_entry *termpaintp_input_lookup_key_mapping(const unsigned char *data, size_t length) {
+    uint32_t hash = 2166136261;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619;
     }
-    if (!ok) {
-        exit(55);
+
+    // the index is at most half full, so there is always an empty slot to terminate the search
+    for (uint32_t slot = hash & KEY_MAPPING_INDEX_MASK; ; slot = (slot + 1) & KEY_MAPPING_INDEX_MASK) {
+        const key_mapping_index_slot *s = &key_mapping_index[slot];
+        if (s->entry == KEY_MAPPING_INDEX_EMPTY) {
+            return nullptr;
+        }
+        if (s->length == length && memcmp(key_mapping_table[s->entry].sequence, data, length) == 0) {
+            return &key_mapping_table[s->entry];
+        }
     }
-    finished = true;
 }
 
 void termpaintp_input_dump_table(void) {
@@ -700,6 +714,12 @@ struct termpaint_input_ {
 
     _Bool in_paste;
     _Bool handle_paste;
+    _Bool batch_text;
+    _Bool coalesce_mouse_motion;
+
+    // mouse motion event held back for coalescing, only used while inside termpaint_input_add_data
+    _Bool motion_pending;
+    termpaint_event pending_motion;
 
     int quirks_len;
     key_mapping_entry *quirks;
@@ -764,6 +784,8 @@ static void termpaintp_input_translate_mouse_flags(termpaint_event* event, int m
     // mode = 1 -> release from final (mode 1006 with 'm' as final)
     // mode = 2 -> press from final (mode 1006 with 'M' as final)
 
+    event->mouse.coalesced = 0;
+
     // shuffle the bits from the raw button and flags
     event->mouse.button = event->mouse.raw_btn_and_flags & 0x3;
     if (event->mouse.raw_btn_and_flags & 0x40) {
@@ -795,6 +817,37 @@ static void termpaintp_input_translate_mouse_flags(termpaint_event* event, int m
     }
 }
 
+static void termpaintp_input_flush_motion(termpaint_input *ctx) {
+    if (ctx->motion_pending) {
+        ctx->motion_pending = false;
+        termpaint_event event = ctx->pending_motion;
+        ctx->event_cb(ctx->event_user_data, &event);
+    }
+}
+
+// Passes event to the event callback. With mouse motion coalescing enabled, motion events are held back until the
+// next event or the end of the current termpaint_input_add_data call, so consecutive motion events with the same
+// buttons and modifiers can be merged.
+static void termpaintp_input_emit(termpaint_input *ctx, termpaint_event *event) {
+    if (ctx->coalesce_mouse_motion && event->type == TERMPAINT_EV_MOUSE
+            && event->mouse.action == TERMPAINT_MOUSE_MOVE) {
+        if (ctx->motion_pending
+                && ctx->pending_motion.mouse.raw_btn_and_flags == event->mouse.raw_btn_and_flags) {
+            int coalesced = ctx->pending_motion.mouse.coalesced + 1 + event->mouse.coalesced;
+            ctx->pending_motion = *event;
+            ctx->pending_motion.mouse.coalesced = coalesced;
+            return;
+        }
+        termpaintp_input_flush_motion(ctx);
+        ctx->pending_motion = *event;
+        ctx->motion_pending = true;
+        return;
+    }
+
+    termpaintp_input_flush_motion(ctx);
+    ctx->event_cb(ctx->event_user_data, event);
+}
+
 static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data, size_t length, _Bool overflow) {
     unsigned char dbl_esc_tmp[21];
     // First handle double escape for alt-ESC
@@ -816,11 +869,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
             if (length + 1 < sizeof (dbl_esc_tmp)) {
                 dbl_esc_tmp[0] = '\033';
                 memcpy(dbl_esc_tmp + 1, data, length);
-                for (const key_mapping_entry* entry = key_mapping_table; entry->sequence != nullptr; entry++) {
-                    if (strlen(entry->sequence) == length + 1 && memcmp(entry->sequence, dbl_esc_tmp, length + 1) == 0) {
-                        found = true;
-                    }
-                }
+                found = termpaintp_input_lookup_key_mapping(dbl_esc_tmp, length + 1) != nullptr;
             }
 
             if (found) {
@@ -837,7 +886,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
                     event.key.length = strlen(ATOM_escape);
                     event.key.atom = ATOM_escape;
                     event.key.modifier = 0;
-                    ctx->event_cb(ctx->event_user_data, &event);
+                    termpaintp_input_emit(ctx, &event);
                 }
             }
         }
@@ -885,14 +934,8 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
             }
         }
 
-        // TODO optimize
         if (!matched_entry) {
-            for (const key_mapping_entry* entry = key_mapping_table; entry->sequence != nullptr; entry++) {
-                if (strlen(entry->sequence) == length && memcmp(entry->sequence, data, length) == 0) {
-                    matched_entry = entry;
-                    break;
-                }
-            }
+            matched_entry = termpaintp_input_lookup_key_mapping(data, length);
         }
         if (matched_entry) {
             if (matched_entry->modifiers & MOD_PRINT) {
@@ -1200,7 +1243,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
                             event2.paste.length = 0;
                             event2.paste.initial = true;
                             event2.paste.final = false;
-                            ctx->event_cb(ctx->event_user_data, &event2);
+                            termpaintp_input_emit(ctx, &event2);
                         } else {
                             event.type = TERMPAINT_EV_MISC;
                             event.misc.atom = termpaint_input_paste_begin();
@@ -1367,7 +1410,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
         }
     }
     if (!ctx->in_paste) {
-        ctx->event_cb(ctx->event_user_data, &event);
+        termpaintp_input_emit(ctx, &event);
     } else {
         // while in paste state ignore anything that is not a plain character.
         // in a paste there shouldn't be any escape sequences, but don't depend on
@@ -1379,7 +1422,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
             event2.paste.length = event.c.length;
             event2.paste.initial = false;
             event2.paste.final = false;
-            ctx->event_cb(ctx->event_user_data, &event2);
+            termpaintp_input_emit(ctx, &event2);
         }
         // some terminals send line breaks as \x0a
         if (event.type == TERMPAINT_EV_CHAR && event.c.modifier == TERMPAINT_MOD_CTRL
@@ -1390,7 +1433,7 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
             event2.paste.length = 1;
             event2.paste.initial = false;
             event2.paste.final = false;
-            ctx->event_cb(ctx->event_user_data, &event2);
+            termpaintp_input_emit(ctx, &event2);
         }
         // But some plain strings are handled as keys, so process those as well
         if (event.type == TERMPAINT_EV_KEY && event.key.modifier == 0) {
@@ -1401,24 +1444,23 @@ static void termpaintp_input_raw(termpaint_input *ctx, const unsigned char *data
             if (event.key.atom == termpaint_input_space()) {
                 event2.paste.string = " ";
                 event2.paste.length = 1;
-                ctx->event_cb(ctx->event_user_data, &event2);
+                termpaintp_input_emit(ctx, &event2);
             }
             if (event.key.atom == termpaint_input_tab()) {
                 event2.paste.string = "\t";
                 event2.paste.length = 1;
-                ctx->event_cb(ctx->event_user_data, &event2);
+                termpaintp_input_emit(ctx, &event2);
             }
             if (event.key.atom == termpaint_input_enter()) {
                 event2.paste.string = "\r";
                 event2.paste.length = 1;
-                ctx->event_cb(ctx->event_user_data, &event2);
+                termpaintp_input_emit(ctx, &event2);
             }
         }
     }
 }
 
 termpaint_input *termpaint_input_new_or_nullptr(void) {
-    termpaintp_input_selfcheck();
     termpaint_input *ctx = calloc(1, sizeof(termpaint_input));
     if (!ctx) {
         return nullptr;
@@ -1499,10 +1541,100 @@ static bool termpaintp_input_legacy_mouse_bytes_finished(termpaint_input *ctx) {
     }
 }
 
+// Returns the length of the run of printable characters at the start of data. Stops before control characters,
+// C1 characters and invalid or incomplete utf-8 sequences.
+static unsigned termpaintp_input_text_run(termpaint_input *ctx, const unsigned char *data, unsigned length) {
+    unsigned i = 0;
+    while (1) {
+        i += termpaintp_utf8_printable_ascii_prefix(data + i, length - i);
+        if (i >= length || data[i] < 0xc0) {
+            return i;
+        }
+        unsigned size = termpaintp_utf8_len(data[i]);
+        if (i + size > length || (size > 4 && !ctx->extended_unicode)
+                || !termpaintp_check_valid_sequence(data + i, size)
+                || (data[i] == 0xc2 && data[i + 1] < 0xa0)) {
+            return i;
+        }
+        i += size;
+    }
+}
+
+static void termpaintp_input_text(termpaint_input *ctx, const unsigned char *data, unsigned length) {
+    if (ctx->raw_filter_cb) {
+        if (ctx->raw_filter_cb(ctx->raw_filter_user_data, (const char *)data, length, false)) {
+            return;
+        }
+    }
+    if (!ctx->event_cb) {
+        return;
+    }
+
+    termpaint_event event;
+    event.type = TERMPAINT_EV_TEXT;
+    event.text.length = length;
+    event.text.string = (const char*)data;
+    termpaintp_input_emit(ctx, &event);
+}
+
+// Returns the length of the start of data that would be passed through unchanged while in a bracketed paste. That is
+// printable characters, tab and line breaks. Everything else, including the end of paste sequence, needs the normal
+// input processing.
+static unsigned termpaintp_input_paste_run(termpaint_input *ctx, const unsigned char *data, unsigned length) {
+    unsigned i = 0;
+    while (1) {
+        i += termpaintp_input_text_run(ctx, data + i, length - i);
+        if (i < length && (data[i] == '\t' || data[i] == '\r' || data[i] == '\n')) {
+            ++i;
+        } else {
+            return i;
+        }
+    }
+}
+
+static void termpaintp_input_paste(termpaint_input *ctx, const unsigned char *data, unsigned length) {
+    if (ctx->raw_filter_cb) {
+        if (ctx->raw_filter_cb(ctx->raw_filter_user_data, (const char *)data, length, false)) {
+            return;
+        }
+    }
+    if (!ctx->event_cb) {
+        return;
+    }
+
+    termpaint_event event;
+    event.type = TERMPAINT_EV_PASTE;
+    event.paste.string = (const char*)data;
+    event.paste.length = length;
+    event.paste.initial = false;
+    event.paste.final = false;
+    termpaintp_input_emit(ctx, &event);
+}
+
 void termpaint_input_add_data(termpaint_input *ctx, const char *data_s, unsigned length) {
     const unsigned char *data = (const unsigned char*)data_s;
 
     for (unsigned i = 0; i < length; i++) {
+        if (ctx->state == tpis_base && ctx->used == 0 && !ctx->esc_pending) {
+            if (ctx->in_paste) {
+                // pasted text is passed on in large chunks directly from data
+                unsigned run = termpaintp_input_paste_run(ctx, data + i, length - i);
+                if (run) {
+                    termpaintp_input_paste(ctx, data + i, run);
+                    i += run - 1;
+                    continue;
+                }
+            } else if (ctx->batch_text) {
+                unsigned run = termpaintp_input_text_run(ctx, data + i, length - i);
+                // a single character is still reported as a normal event
+                if (run > (data[i] < 0x80 ? 1 : (unsigned)termpaintp_utf8_len(data[i]))) {
+                    termpaintp_input_text(ctx, data + i, run);
+                    i += run - 1;
+                    continue;
+                }
+            }
+        }
+
         // Protect against overlong sequences
         if (ctx->used == MAX_SEQ_LENGTH) {
             // go to error recovery
@@ -1711,6 +1843,10 @@ void termpaint_input_add_data(termpaint_input *ctx, const char *data_s, unsigned
             --i; // process this char again
         }
     }
+
+    if (ctx->event_cb) {
+        termpaintp_input_flush_motion(ctx);
+    }
 }
 
 
@@ -1818,6 +1954,14 @@ void termpaint_input_activate_quirk(termpaint_input *ctx, int quirk) {
     }
 }
 
+void termpaint_input_coalesce_mouse_motion(termpaint_input *ctx, bool enable) {
+    ctx->coalesce_mouse_motion = enable;
+}
+
+void termpaint_input_batch_text(termpaint_input *ctx, bool enable) {
+    ctx->batch_text = enable;
+}
+
 void termpaint_input_handle_paste(termpaint_input *ctx, bool enable) {
     ctx->handle_paste = enable;
     if (!enable) {
@@ -34,6 +34,8 @@ _tERMPAINT_PUBLIC void termpaint_input_expect_cursor_position_report(termpaint_i
 _tERMPAINT_PUBLIC void termpaint_input_expect_legacy_mouse_reports(termpaint_input *ctx, int s);
 _tERMPAINT_PUBLIC void termpaint_input_handle_paste(termpaint_input *ctx, _Bool enable);
 _tERMPAINT_PUBLIC void termpaint_input_expect_apc_sequences(termpaint_input *ctx, _Bool enable);
+_tERMPAINT_PUBLIC void termpaint_input_batch_text(termpaint_input *ctx, _Bool enable);
+_tERMPAINT_PUBLIC void termpaint_input_coalesce_mouse_motion(termpaint_input *ctx, _Bool enable);
 
 _tERMPAINT_PUBLIC const char* termpaint_input_peek_buffer(const termpaint_input *ctx);
 _tERMPAINT_PUBLIC int termpaint_input_peek_buffer_length(const termpaint_input *ctx);
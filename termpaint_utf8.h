@@ -4,6 +4,15 @@
 
 // internal header, not api or abi stable
 
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*
   x = any bit value
   y = at least one needs to be set (to detect overlong encodings which are invalid)
@@ -140,6 +149,102 @@ static inline _Bool termpaintp_check_valid_sequence(const unsigned char *input,
 #undef CHECK_CONTINUATION_BYTE
 }
 
+// Returns the length of the prefix of input that only contains ASCII (< 0x80) bytes.
+static inline int termpaintp_utf8_ascii_prefix(const unsigned char *input, int length) {
+    int i = 0;
+#if defined(__SSE2__)
+    while (i + 16 <= length) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(input + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    while (i + 16 <= length) {
+        if (vmaxvq_u8(vld1q_u8(input + i)) >= 0x80) {
+            break;
+        }
+        i += 16;
+    }
+#else
+    while (i + 8 <= length) {
+        uint64_t v;
+        memcpy(&v, input + i, 8);
+        if (v & 0x8080808080808080ull) {
+            break;
+        }
+        i += 8;
+    }
+#endif
+    while (i < length && input[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the length of the prefix of input that only contains printable ASCII (0x20 to 0x7e) bytes.
+static inline int termpaintp_utf8_printable_ascii_prefix(const unsigned char *input, int length) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i below = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    while (i + 16 <= length) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(input + i));
+        // signed compare, so bytes >= 0x80 are not printable either
+        __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, below));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(printable) & 0xffff;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    while (i + 16 <= length) {
+        uint8x16_t v = vld1q_u8(input + i);
+        uint8x16_t printable = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x20)), vcltq_u8(v, vdupq_n_u8(0x7f)));
+        if (vminvq_u8(printable) != 0xff) {
+            break;
+        }
+        i += 16;
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    while (i + 8 <= length) {
+        uint64_t v;
+        memcpy(&v, input + i, 8);
+        uint64_t del = v ^ (0x7f * ones);
+        // any byte >= 0x80, any byte < 0x20 or any byte == 0x7f
+        if ((v & highs) || ((v - 0x20 * ones) & ~v & highs) || ((del - ones) & ~del & highs)) {
+            break;
+        }
+        i += 8;
+    }
+#endif
+    while (i < length && input[i] >= 0x20 && input[i] < 0x7f) {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the length of the longest prefix of input that only consists of complete sequences that are accepted by
+// termpaintp_check_valid_sequence. Runs of ASCII are skipped in blocks.
+static inline int termpaintp_utf8_valid_prefix(const unsigned char *input, int length) {
+    int i = 0;
+    while (1) {
+        i += termpaintp_utf8_ascii_prefix(input + i, length - i);
+        if (i >= length) {
+            return length;
+        }
+        int size = termpaintp_utf8_len(input[i]);
+        if (i + size > length || !termpaintp_check_valid_sequence(input + i, size)) {
+            return i;
+        }
+        i += size;
+    }
+}
+
 // return count of bytes written
 // buffer needs to be 6 bytes long
 // does not reject UTF-16 surrogates codepoints
@@ -1,11 +1,13 @@
 // SPDX-License-Identifier: BSL-1.0
 #include <stdlib.h>
+#include <string.h>
 
 #include <array>
 #include <map>
 #include <set>
 
 #include <termpaint.h>
+#include <termpaint_utf8.h>
 #include "testhelper.h"
 
 #ifndef BUNDLED_CATCH2
@@ -2755,3 +2757,158 @@ TEST_CASE("finger printing") {
         }
     }
 }
+
+TEST_CASE("width calibration") {
+    const std::string name = GENERATE(as<std::string>{}, "xterm 354", "DA3 new id promise (no safe-CPR)");
+    CAPTURE(name);
+
+    const TestCase *testcase = nullptr;
+    for (const auto& candidate : tests) {
+        if (candidate.name.substr(0, name.size() + 1) == name + " ") {
+            testcase = &candidate;
+        }
+    }
+    REQUIRE(testcase);
+
+    struct Integration : public termpaint_integration {
+        std::string sent;
+    } integration;
+
+    termpaint_integration_init(&integration,
+                               [] (termpaint_integration*) {}, // free
+                               [] (termpaint_integration *integration_generic, const char *data, int length) {
+                                    auto& integration = *static_cast<Integration*>(integration_generic);
+                                    integration.sent.append(data, length);
+                               },
+                               [] (termpaint_integration*) {} // flush
+                            );
+
+    std::vector<int> events;
+
+    terminal_uptr term;
+    term.reset(termpaint_terminal_new(&integration));
+    termpaint_terminal_set_event_cb(term, [] (void *ctx, termpaint_event *event) {
+        static_cast<std::vector<int>*>(ctx)->push_back(event->type);
+    }, &events);
+
+    termpaint_surface *surface = termpaint_terminal_get_surface(term);
+
+    // widths the simulated terminal uses, everything else matches termpaint's tables
+    std::map<int, int> terminalWidths;
+    int cursorX = 0;
+
+    auto run = [&] {
+        while (integration.sent.size()) {
+            const std::string& sent = integration.sent;
+            if (sent[0] == '\r') {
+                cursorX = 0;
+                integration.sent = sent.substr(1);
+            } else if (sent.substr(0, 3) == "\033[K") {
+                integration.sent = sent.substr(3);
+            } else if (sent[0] == '\033') {
+                bool found = false;
+                for (const auto& seq : allSeq) {
+                    if (sent.substr(0, strlen(seq)) == seq) {
+                        std::string reply = replace(testcase->seq.at(seq).reply, "{POS}",
+                                                    "1;" + std::to_string(cursorX + 1));
+                        integration.sent = sent.substr(strlen(seq));
+                        termpaint_terminal_add_input_data(term, reply.data(), reply.size());
+                        found = true;
+                        break;
+                    }
+                }
+                REQUIRE(found);
+            } else {
+                int len = termpaintp_utf8_len(static_cast<unsigned char>(sent[0]));
+                REQUIRE(len <= static_cast<int>(sent.size()));
+                int codepoint = termpaintp_utf8_decode_from_utf8(reinterpret_cast<const unsigned char*>(sent.data()), len);
+                auto it = terminalWidths.find(codepoint);
+                cursorX += it != terminalWidths.end() ? it->second : termpaint_surface_char_width(surface, codepoint);
+                integration.sent = sent.substr(len);
+            }
+        }
+    };
+
+    CHECK(!termpaint_terminal_calibrate_char_widths(term));
+
+    termpaint_terminal_auto_detect(term);
+    run();
+    REQUIRE(termpaint_terminal_auto_detect_state(term) == termpaint_auto_detect_done);
+    events.clear();
+
+    const int boxWidth = termpaint_surface_char_width(surface, 0x2500);
+    CHECK(termpaint_surface_char_width(surface, 0x3b1) == 1);
+    CHECK(termpaint_surface_char_width(surface, 0x1f914) == 2);
+
+    // prepared before calibration
+    unique_cptr<termpaint_prepared_text, termpaint_prepared_text_free> text;
+    text.reset(termpaint_prepared_text_new(surface, "\u03b1x", -1));
+    CHECK(termpaint_prepared_text_width(text) == 2);
+
+    terminalWidths[0x3b1] = 2;
+    terminalWidths[0x1f914] = 1;
+
+    std::vector<std::string> rawInput;
+    termpaint_terminal_set_raw_input_filter_cb(term, [] (void *ctx, const char *data, unsigned length, _Bool) {
+        static_cast<std::vector<std::string>*>(ctx)->push_back(std::string(data, length));
+        return false;
+    }, &rawInput);
+
+    REQUIRE(termpaint_terminal_calibrate_char_widths(term));
+    // calibration runs while the application is live
+    CHECK(termpaint_terminal_auto_detect_state(term) == termpaint_auto_detect_done);
+    const std::string calibrationQueries = integration.sent;
+
+    // unrelated input is still delivered and passes the raw input filter
+    termpaint_terminal_add_input_data(term, "x\033[A", 4);
+    CHECK(events == std::vector<int>{ TERMPAINT_EV_CHAR, TERMPAINT_EV_KEY });
+    CHECK(rawInput == std::vector<std::string>{ "x", "\033[A" });
+
+    // a lone ESC requests a status report to finish it
+    termpaint_terminal_add_input_data(term, "\033", 1);
+    CHECK(integration.sent == calibrationQueries + "\033[5n");
+    CHECK(events.size() == 2);
+
+    run();
+    // the reply to the status report for the ESC arrives after calibration is done
+    CHECK(events == std::vector<int>{ TERMPAINT_EV_CHAR, TERMPAINT_EV_KEY, TERMPAINT_EV_KEY,
+                                      TERMPAINT_EV_CHAR_WIDTHS_CALIBRATED, TERMPAINT_EV_MISC });
+    CHECK(termpaint_terminal_auto_detect_state(term) == termpaint_auto_detect_done);
+    termpaint_terminal_set_raw_input_filter_cb(term, nullptr, nullptr);
+
+    CHECK(termpaint_surface_char_width(surface, 0x3b1) == 2);
+    CHECK(termpaint_surface_char_width(surface, 0x3c9) == 2);
+    CHECK(termpaint_surface_char_width(surface, 0x410) == 2);
+    CHECK(termpaint_surface_char_width(surface, 0x3b0) == 1);
+    CHECK(termpaint_surface_char_width(surface, 0x1f914) == 1);
+    CHECK(termpaint_surface_char_width(surface, 0x1f9d0) == 1);
+    CHECK(termpaint_surface_char_width(surface, 0x2500) == boxWidth);
+    CHECK(termpaint_surface_char_width(surface, 'a') == 1);
+
+    // prepared text is updated for the calibrated widths when written
+    unique_cptr<termpaint_surface, termpaint_surface_free> target;
+    target.reset(termpaint_terminal_new_surface(term, 10, 1));
+    CHECK(termpaint_surface_write_prepared_with_colors(target, 0, 0, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, -1) == 3);
+    CHECK(termpaint_prepared_text_width(text) == 3);
+    CHECK(termpaint_surface_write_prepared_with_colors(target, 4, 0, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, -1) == 3);
+    int len, left, right;
+    termpaint_surface_peek_text(target, 4, 0, &len, &left, &right);
+    CHECK(right == 5);
+    target.reset();
+    text.reset();
+
+    // terminal now agrees with the built-in tables, overrides from the previous run are removed
+    terminalWidths[0x3b1] = 1;
+    terminalWidths[0x1f914] = 2;
+    events.clear();
+    REQUIRE(termpaint_terminal_calibrate_char_widths(term));
+    run();
+    CHECK(events == std::vector<int>{ TERMPAINT_EV_CHAR_WIDTHS_CALIBRATED });
+    CHECK(termpaint_surface_char_width(surface, 0x3b1) == 1);
+    CHECK(termpaint_surface_char_width(surface, 0x1f914) == 2);
+
+    term.reset();
+    termpaint_integration_deinit(&integration);
+}
@@ -1013,6 +1013,67 @@ TEST_CASE("input: mouse report") {
     termpaint_input_free(input_ctx);
 }
 
+TEST_CASE("input: mouse motion coalescing") {
+    struct Event {
+        int type;
+        int x;
+        int y;
+        int action;
+        int coalesced;
+        bool operator==(const Event& other) const {
+            return type == other.type && x == other.x && y == other.y && action == other.action
+                    && coalesced == other.coalesced;
+        }
+    };
+    std::vector<Event> events;
+    std::function<void(termpaint_event* event)> event_callback
+            = [&] (termpaint_event* event) -> void {
+        if (event->type == TERMPAINT_EV_MOUSE) {
+            events.push_back({event->type, event->mouse.x, event->mouse.y, event->mouse.action, event->mouse.coalesced});
+        } else {
+            events.push_back({event->type, 0, 0, 0, 0});
+        }
+    };
+    termpaint_input *input_ctx = termpaint_input_new();
+    wrap(termpaint_input_set_event_cb, input_ctx, event_callback);
+
+    const std::string moves = "\033[<35;1;1M\033[<35;2;1M\033[<35;3;1M\033[<35;4;2M";
+    const std::string drags = "\033[<32;5;2M\033[<32;6;2M";
+
+    SECTION("disabled") {
+        termpaint_input_add_data(input_ctx, moves.data(), moves.size());
+        CHECK(events.size() == 4);
+    }
+
+    SECTION("enabled") {
+        termpaint_input_coalesce_mouse_motion(input_ctx, true);
+
+        std::string sequence = moves + "\033[<0;4;2M" + moves + drags + "a" + moves;
+        termpaint_input_add_data(input_ctx, sequence.data(), sequence.size());
+        CHECK(events == std::vector<Event>{
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_MOVE, 3 },
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_PRESS, 0 },
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_MOVE, 3 },
+                  { TERMPAINT_EV_MOUSE, 5, 1, TERMPAINT_MOUSE_MOVE, 1 },
+                  { TERMPAINT_EV_CHAR, 0, 0, 0, 0 },
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_MOVE, 3 },
+              });
+
+        // only reports in the same chunk of data are coalesced
+        events.clear();
+        for (int i = 0; i < 2; i++) {
+            termpaint_input_add_data(input_ctx, moves.data(), moves.size());
+        }
+        CHECK(events == std::vector<Event>{
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_MOVE, 3 },
+                  { TERMPAINT_EV_MOUSE, 3, 1, TERMPAINT_MOUSE_MOVE, 3 },
+              });
+    }
+
+    REQUIRE(termpaint_input_peek_buffer_length(input_ctx) == 0);
+    termpaint_input_free(input_ctx);
+}
+
 TEST_CASE("input: legacy mouse disable") {
     std::string sequence = "\033[M!!!";
     enum { START, GOT_UNKNOWN, GOT_BANG1, GOT_BANG2, GOT_BANG3 } state = START;
@@ -1244,6 +1305,146 @@ TEST_CASE("input: bracketed paste handling") {
     termpaint_input_free(input_ctx);
 }
 
+TEST_CASE("input: bracketed paste streaming") {
+    std::string pasted_data;
+    int paste_events = 0;
+    bool finished = false;
+    const char *input_begin = nullptr;
+    const char *input_end = nullptr;
+    bool pointsIntoInput = true;
+    std::function<void(termpaint_event* event)> event_callback
+            = [&] (termpaint_event* event) -> void {
+        REQUIRE(event->type == TERMPAINT_EV_PASTE);
+        REQUIRE(!finished);
+        if (event->paste.length > 1
+                && (event->paste.string < input_begin || event->paste.string + event->paste.length > input_end)) {
+            pointsIntoInput = false;
+        }
+        pasted_data += std::string(event->paste.string, event->paste.length);
+        finished = event->paste.final;
+        ++paste_events;
+    };
+    termpaint_input *input_ctx = termpaint_input_new();
+    wrap(termpaint_input_set_event_cb, input_ctx, event_callback);
+
+    SECTION("large paste") {
+        std::string content;
+        for (int i = 0; i < 20000; i++) {
+            content += "line " + std::to_string(i) + "\t\xc3\xa4\xe3\x81\x82\n";
+        }
+        std::string sequence = "\033[200~" + content + "\033[201~";
+        input_begin = sequence.data();
+        input_end = sequence.data() + sequence.size();
+        termpaint_input_add_data(input_ctx, sequence.data(), sequence.size());
+        CHECK(finished);
+        CHECK(pasted_data == content);
+        // initial, content and final
+        CHECK(paste_events == 3);
+        CHECK(pointsIntoInput);
+    }
+
+    SECTION("same filtering as unbatched processing") {
+        std::string sequence = "\033[200~ab\x01" "c\r\n\x7f\xc2\x85\xff" "d\033[A" "e\033[201~";
+        input_begin = sequence.data();
+        input_end = sequence.data() + sequence.size();
+        termpaint_input_add_data(input_ctx, sequence.data(), sequence.size());
+        CHECK(finished);
+        CHECK(pasted_data == "abc\r\n\xc2\x85" "de");
+    }
+
+    SECTION("split in chunks") {
+        std::string content = "abc\xe3\x81\x82" "def";
+        std::string sequence = "\033[200~" + content + "\033[201~";
+        for (size_t i = 0; i < sequence.size(); i += 4) {
+            std::string chunk = sequence.substr(i, 4);
+            input_begin = chunk.data();
+            input_end = chunk.data() + chunk.size();
+            termpaint_input_add_data(input_ctx, chunk.data(), chunk.size());
+        }
+        CHECK(finished);
+        CHECK(pasted_data == content);
+    }
+
+    REQUIRE(termpaint_input_peek_buffer_length(input_ctx) == 0);
+    termpaint_input_free(input_ctx);
+}
+
+TEST_CASE("input: batched text") {
+    struct Event {
+        int type;
+        std::string str;
+        bool operator==(const Event& other) const { return type == other.type && str == other.str; }
+    };
+    std::vector<Event> events;
+    std::function<void(termpaint_event* event)> event_callback
+            = [&] (termpaint_event* event) -> void {
+        if (event->type == TERMPAINT_EV_TEXT) {
+            events.push_back({event->type, std::string(event->text.string, event->text.length)});
+        } else if (event->type == TERMPAINT_EV_CHAR) {
+            events.push_back({event->type, std::string(event->c.string, event->c.length)});
+        } else if (event->type == TERMPAINT_EV_KEY) {
+            events.push_back({event->type, std::string(event->key.atom, event->key.length)});
+        } else if (event->type == TERMPAINT_EV_PASTE) {
+            events.push_back({event->type, std::string(event->paste.string, event->paste.length)});
+        } else {
+            events.push_back({event->type, ""});
+        }
+    };
+    termpaint_input *input_ctx = termpaint_input_new();
+    wrap(termpaint_input_set_event_cb, input_ctx, event_callback);
+    termpaint_input_batch_text(input_ctx, true);
+
+    auto feed = [&] (const std::string& data) {
+        events.clear();
+        termpaint_input_add_data(input_ctx, data.data(), data.size());
+    };
+
+    feed("hello world");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_TEXT, "hello world" }});
+
+    feed("a");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_CHAR, "a" }});
+
+    feed("\xc3\xa4");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_CHAR, "\xc3\xa4" }});
+
+    feed("ab\033[Acd\xc3\xa4\xe3\x81\x82");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_TEXT, "ab" }, { TERMPAINT_EV_KEY, "ArrowUp" },
+                                       { TERMPAINT_EV_TEXT, "cd\xc3\xa4\xe3\x81\x82" }});
+
+    feed("ab\x01" "cd\xc2\x85" "ef");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_TEXT, "ab" }, { TERMPAINT_EV_CHAR, "a" },
+                                       { TERMPAINT_EV_TEXT, "cd" }, { TERMPAINT_EV_CHAR, "\xc2\x85" },
+                                       { TERMPAINT_EV_TEXT, "ef" }});
+
+    std::string longText = std::string(40, 'x') + "\t" + std::string(70, 'y');
+    feed(longText);
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_TEXT, std::string(40, 'x') }, { TERMPAINT_EV_KEY, "Tab" },
+                                       { TERMPAINT_EV_TEXT, std::string(70, 'y') }});
+
+    // incomplete utf-8 sequence at the end is completed by the next chunk
+    feed("ab\xc3");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_TEXT, "ab" }});
+    CHECK(termpaint_input_peek_buffer_length(input_ctx) == 1);
+    feed("\xa4");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_CHAR, "\xc3\xa4" }});
+
+    // pastes are not affected
+    feed("\033[200~abc\033[201~");
+    std::string pasted;
+    for (const auto& event: events) {
+        CHECK(event.type == TERMPAINT_EV_PASTE);
+        pasted += event.str;
+    }
+    CHECK(pasted == "abc");
+
+    termpaint_input_batch_text(input_ctx, false);
+    feed("ab");
+    CHECK(events == std::vector<Event>{{ TERMPAINT_EV_CHAR, "a" }, { TERMPAINT_EV_CHAR, "b" }});
+
+    termpaint_input_free(input_ctx);
+}
+
 TEST_CASE("input: retriggering") {
     // test mechanism to detect end of sequences that are prefixes to other valid sequence types.
     // this also force terminates most unterminated sequences.
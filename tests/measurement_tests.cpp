@@ -941,3 +941,262 @@ TEST_CASE( "Continue measurements for strings", "[measurement]") {
         }
     }
 }
+
+TEST_CASE("Measurements for ascii runs match codepoint path", "[measurement]") {
+    // feed_utf8 handles runs of printable ascii in blocks, compare with feeding each codepoint separately.
+    const std::string str = GENERATE(as<std::string>(), "hello world", "abc\u0308def", "\u0308abc", "ab\x7f" "cd",
+                                     "abcあdef", "a\tb c");
+    const int limitKind = GENERATE(0, 1, 2, 3);
+    CAPTURE(str);
+    CAPTURE(limitKind);
+
+    std::u32string str32 = toUtf32(str);
+
+    for (int limit = 0; limit <= toInt(str.size()) + 2; limit++) {
+        CAPTURE(limit);
+        for (bool pending: {false, true}) {
+            CAPTURE(pending);
+            MeasurementWrapper tm8;
+            MeasurementWrapper tmRef;
+            for (auto tm: {tm8.get(), tmRef.get()}) {
+                // start with some pending state to check that it is committed correctly.
+                if (pending) {
+                    termpaint_text_measurement_feed_codepoint(tm, 'x', 1);
+                }
+                switch (limitKind) {
+                    case 0: termpaint_text_measurement_set_limit_codepoints(tm, limit); break;
+                    case 1: termpaint_text_measurement_set_limit_clusters(tm, limit); break;
+                    case 2: termpaint_text_measurement_set_limit_width(tm, limit); break;
+                    case 3: termpaint_text_measurement_set_limit_ref(tm, limit); break;
+                }
+            }
+
+            bool reached8 = termpaint_text_measurement_feed_utf8(tm8.get(), str.data(), toInt(str.size()), true);
+
+            bool reachedRef = false;
+            for (char32_t ch: str32) {
+                int units = ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+                if (termpaint_text_measurement_feed_codepoint(tmRef.get(), static_cast<int>(ch), units)
+                        & TERMPAINT_MEASURE_LIMIT_REACHED) {
+                    reachedRef = true;
+                    break;
+                }
+            }
+            if (!reachedRef) {
+                reachedRef = termpaint_text_measurement_feed_utf32(tmRef.get(), nullptr, 0, true);
+            }
+
+            CHECK(reached8 == reachedRef);
+            CHECK(termpaint_text_measurement_last_codepoints(tm8.get())
+                  == termpaint_text_measurement_last_codepoints(tmRef.get()));
+            CHECK(termpaint_text_measurement_last_clusters(tm8.get())
+                  == termpaint_text_measurement_last_clusters(tmRef.get()));
+            CHECK(termpaint_text_measurement_last_width(tm8.get())
+                  == termpaint_text_measurement_last_width(tmRef.get()));
+            CHECK(termpaint_text_measurement_last_ref(tm8.get())
+                  == termpaint_text_measurement_last_ref(tmRef.get()));
+        }
+    }
+}
+
+TEST_CASE("Measurement cache gives same results", "[measurement]") {
+    const std::string str = GENERATE(as<std::string>(), "hello world", "abc\u0308def", "\u0308abc", "ab\x7f",
+                                     "ab\x7f\u0308" "cd", "abcあdef", "a\xff\xe3\x81\x82", "x\xe3\x81");
+    const int limitKind = GENERATE(0, 1, 2, 3);
+    CAPTURE(str);
+    CAPTURE(limitKind);
+
+    MeasurementWrapper cached;
+    termpaint_text_measurement_set_cache_size(cached.get(), 4);
+
+    for (int limit = 0; limit <= toInt(str.size()) + 2; limit++) {
+        CAPTURE(limit);
+        MeasurementWrapper uncached;
+        termpaint_text_measurement_reset(cached.get());
+        for (auto tm: {cached.get(), uncached.get()}) {
+            switch (limitKind) {
+                case 0: termpaint_text_measurement_set_limit_codepoints(tm, limit); break;
+                case 1: termpaint_text_measurement_set_limit_clusters(tm, limit); break;
+                case 2: termpaint_text_measurement_set_limit_width(tm, limit); break;
+                case 3: termpaint_text_measurement_set_limit_ref(tm, limit); break;
+            }
+        }
+
+        for (int round = 0; round < 2; round++) {
+            CAPTURE(round);
+            // second round continues after the result of the first round
+            const int offset = round ? termpaint_text_measurement_last_ref(uncached.get()) : 0;
+            if (round) {
+                for (auto tm: {cached.get(), uncached.get()}) {
+                    termpaint_text_measurement_set_limit_clusters(tm, termpaint_text_measurement_last_clusters(tm) + 1);
+                }
+            }
+            bool reachedCached = termpaint_text_measurement_feed_utf8(cached.get(), str.data() + offset,
+                                                                      toInt(str.size()) - offset, true);
+            bool reachedUncached = termpaint_text_measurement_feed_utf8(uncached.get(), str.data() + offset,
+                                                                        toInt(str.size()) - offset, true);
+            CHECK(reachedCached == reachedUncached);
+            CHECK(termpaint_text_measurement_last_codepoints(cached.get())
+                  == termpaint_text_measurement_last_codepoints(uncached.get()));
+            CHECK(termpaint_text_measurement_last_clusters(cached.get())
+                  == termpaint_text_measurement_last_clusters(uncached.get()));
+            CHECK(termpaint_text_measurement_last_width(cached.get())
+                  == termpaint_text_measurement_last_width(uncached.get()));
+            CHECK(termpaint_text_measurement_last_ref(cached.get())
+                  == termpaint_text_measurement_last_ref(uncached.get()));
+            CHECK(termpaint_text_measurement_pending_ref(cached.get())
+                  == termpaint_text_measurement_pending_ref(uncached.get()));
+        }
+    }
+
+    if (str != "x\xe3\x81") {
+        CHECK(termpaint_text_measurement_cache_misses(cached.get()) == 1);
+        CHECK(termpaint_text_measurement_cache_hits(cached.get()) == toUInt(str.size()) + 2);
+    }
+}
+
+TEST_CASE("Measurement cache eviction", "[measurement]") {
+    MeasurementWrapper tm;
+    CHECK(termpaint_text_measurement_cache_hits(tm.get()) == 0);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 0);
+
+    termpaint_text_measurement_set_cache_size(tm.get(), 2);
+
+    auto measure = [&](const std::string &str) {
+        termpaint_text_measurement_reset(tm.get());
+        termpaint_text_measurement_feed_utf8(tm.get(), str.data(), toInt(str.size()), true);
+        return termpaint_text_measurement_last_width(tm.get());
+    };
+
+    CHECK(measure("abc") == 3);
+    CHECK(measure("あい") == 4);
+    CHECK(measure("abc") == 3);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 2);
+    CHECK(termpaint_text_measurement_cache_hits(tm.get()) == 1);
+
+    // evicts "あい" as least recently used
+    CHECK(measure("de") == 2);
+    CHECK(measure("abc") == 3);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 3);
+    CHECK(termpaint_text_measurement_cache_hits(tm.get()) == 2);
+    CHECK(measure("あい") == 4);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 4);
+
+    // only complete strings from the start of a measurement use the cache
+    termpaint_text_measurement_reset(tm.get());
+    termpaint_text_measurement_feed_utf8(tm.get(), "abc", 3, false);
+    termpaint_text_measurement_feed_utf8(tm.get(), "de", 2, true);
+    CHECK(termpaint_text_measurement_last_width(tm.get()) == 5);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 4);
+    CHECK(termpaint_text_measurement_cache_hits(tm.get()) == 2);
+
+    termpaint_text_measurement_set_cache_size(tm.get(), 0);
+    CHECK(measure("abc") == 3);
+    CHECK(termpaint_text_measurement_cache_hits(tm.get()) == 0);
+    CHECK(termpaint_text_measurement_cache_misses(tm.get()) == 0);
+}
+
+namespace {
+    struct Line {
+        std::string text;
+        int clusters;
+        int width;
+
+        bool operator==(const Line &other) const {
+            return text == other.text && clusters == other.clusters && width == other.width;
+        }
+    };
+
+    std::ostream &operator<<(std::ostream &os, const Line &line) {
+        return os << "{\"" << line.text << "\", " << line.clusters << ", " << line.width << "}";
+    }
+
+    std::vector<Line> layout(const std::string &text, int width, int mode) {
+        MeasurementWrapper tm;
+        termpaint_surface *surface = termpaint_terminal_get_surface(tm.terminal);
+        int count = termpaint_text_layout_utf8(surface, text.data(), toInt(text.size()), width, mode, nullptr, 0);
+        std::vector<termpaint_text_line> lines(static_cast<size_t>(count));
+        CHECK(termpaint_text_layout_utf8(surface, text.data(), toInt(text.size()), width, mode,
+                                         lines.data(), count) == count);
+        std::vector<Line> result;
+        for (const termpaint_text_line &line: lines) {
+            result.push_back({text.substr(static_cast<size_t>(line.offset), static_cast<size_t>(line.length)),
+                              line.clusters, line.width});
+        }
+        return result;
+    }
+}
+
+TEST_CASE("Paragraph layout", "[measurement]") {
+    SECTION("empty") {
+        CHECK(layout("", 10, TERMPAINT_TEXT_BREAK_CLUSTERS) == std::vector<Line>{{"", 0, 0}});
+        CHECK(layout("", 10, TERMPAINT_TEXT_BREAK_WHITESPACE) == std::vector<Line>{{"", 0, 0}});
+    }
+    SECTION("clusters") {
+        CHECK(layout("abcdefgh", 3, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"abc", 3, 3}, {"def", 3, 3}, {"gh", 2, 2}});
+        CHECK(layout("ab cd", 3, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"ab ", 3, 3}, {"cd", 2, 2}});
+        CHECK(layout("äbcd", 2, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"äb", 2, 2}, {"cd", 2, 2}});
+    }
+    SECTION("wide characters") {
+        CHECK(layout("aあいう", 4, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"aあ", 2, 3}, {"いう", 2, 4}});
+        CHECK(layout("あい", 1, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"あ", 1, 2}, {"い", 1, 2}});
+        CHECK(layout("ab", 0, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"a", 1, 1}, {"b", 1, 1}});
+    }
+    SECTION("whitespace") {
+        CHECK(layout("the quick brown fox", 10, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"the quick", 9, 9}, {"brown fox", 9, 9}});
+        CHECK(layout("the quick brown fox", 9, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"the quick", 9, 9}, {"brown fox", 9, 9}});
+        CHECK(layout("the quick brown fox", 8, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"the", 3, 3}, {"quick", 5, 5}, {"brown", 5, 5}, {"fox", 3, 3}});
+        CHECK(layout("a   b", 3, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"a", 1, 1}, {"b", 1, 1}});
+        CHECK(layout("a b c", 10, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"a b c", 5, 5}});
+    }
+    SECTION("whitespace - carry over") {
+        // the break is only known to be needed after "cd" was already added to the line
+        CHECK(layout("ab cdef", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"ab", 2, 2}, {"cdef", 4, 4}});
+        CHECK(layout("a b cdefg", 6, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"a b", 3, 3}, {"cdefg", 5, 5}});
+    }
+    SECTION("whitespace - long word") {
+        CHECK(layout("ab cdefghij k", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"ab", 2, 2}, {"cdef", 4, 4}, {"ghij", 4, 4}, {"k", 1, 1}});
+    }
+    SECTION("whitespace - leading and trailing") {
+        CHECK(layout("  ab cd", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"  ab", 4, 4}, {"cd", 2, 2}});
+        CHECK(layout("ab  ", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"ab  ", 4, 4}});
+        CHECK(layout("ab   ", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"ab", 2, 2}});
+    }
+    SECTION("whitespace - space with combining mark") {
+        // a space with a combining mark is not a break opportunity
+        CHECK(layout("ab \u0308cd", 3, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"ab \u0308", 3, 3}, {"cd", 2, 2}});
+        CHECK(layout("a \u0308b cd", 4, TERMPAINT_TEXT_BREAK_WHITESPACE)
+              == std::vector<Line>{{"a \u0308b", 3, 3}, {"cd", 2, 2}});
+    }
+    SECTION("max_lines") {
+        MeasurementWrapper tm;
+        termpaint_surface *surface = termpaint_terminal_get_surface(tm.terminal);
+        termpaint_text_line lines[2];
+        CHECK(termpaint_text_layout_utf8(surface, "abcdefg", 7, 2, TERMPAINT_TEXT_BREAK_CLUSTERS, lines, 2) == 4);
+        CHECK(lines[0].offset == 0);
+        CHECK(lines[1].offset == 2);
+        CHECK(lines[1].length == 2);
+    }
+    SECTION("invalid utf8") {
+        CHECK(layout("a\xffz\xe3\x81", 1, TERMPAINT_TEXT_BREAK_CLUSTERS)
+              == std::vector<Line>{{"a", 1, 1}, {"\xff", 1, 1}, {"z", 1, 1}, {"\xe3\x81", 1, 1}});
+    }
+}
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <map>
 #include <limits>
+#include <thread>
+#include <vector>
 
 #ifndef BUNDLED_CATCH2
 #ifdef CATCH3
@@ -38,6 +40,7 @@ struct unique_cptr : public std::unique_ptr<T, Deleter<T, del>> {
 
 using uattr_ptr = unique_cptr<termpaint_attr, termpaint_attr_free>;
 using usurface_ptr = unique_cptr<termpaint_surface, termpaint_surface_free>;
+using uprepared_text_ptr = unique_cptr<termpaint_prepared_text, termpaint_prepared_text_free>;
 
 
 struct Fixture {
@@ -338,6 +341,272 @@ TEST_CASE("simple text - with len, attr and clipped") {
 }
 
 
+TEST_CASE("write spans") {
+    Fixture f{80, 6};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_attr *attr = termpaint_attr_new(TERMPAINT_COLOR_RED, TERMPAINT_COLOR_BLACK);
+    termpaint_attr_set_style(attr, TERMPAINT_STYLE_BOLD);
+    termpaint_attr *attr_url = termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_attr_set_patch(attr_url, true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\");
+
+    termpaint_write_span spans[] = {
+        { 10, 3, "SampleX", 6, attr, 12, 80 },
+        { 0, 1, "ab", -1, attr_url, 0, 80 },
+        { 1, 1, "あ", -1, attr, 0, 80 },
+        { 78, 2, "xyz", -1, attr_url, 0, 80 },
+    };
+    termpaint_surface_write_spans(f.surface, spans, 4);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 12, 3 }, singleWideChar("m").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_COLOR_BLACK).withStyle(TERMPAINT_STYLE_BOLD)},
+        {{ 13, 3 }, singleWideChar("p").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_COLOR_BLACK).withStyle(TERMPAINT_STYLE_BOLD)},
+        {{ 14, 3 }, singleWideChar("l").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_COLOR_BLACK).withStyle(TERMPAINT_STYLE_BOLD)},
+        {{ 15, 3 }, singleWideChar("e").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_COLOR_BLACK).withStyle(TERMPAINT_STYLE_BOLD)},
+        {{ 0, 1 }, singleWideChar("a").withPatch(true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\")},
+        {{ 1, 1 }, doubleWideChar("あ").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_COLOR_BLACK).withStyle(TERMPAINT_STYLE_BOLD)},
+        {{ 78, 2 }, singleWideChar("x").withPatch(true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\")},
+        {{ 79, 2 }, singleWideChar("y").withPatch(true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\")},
+    });
+
+    termpaint_attr_free(attr);
+    termpaint_attr_free(attr_url);
+}
+
+
+TEST_CASE("write spans - many attributes") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    using namespace std::literals;
+    std::vector<uattr_ptr> attrs;
+    std::vector<std::string> setups;
+    for (int i = 0; i < 40; i++) {
+        setups.push_back("\033]8;;http://example.com\033\\"s + std::to_string(i));
+        attrs.push_back(uattr_ptr::take_ownership(termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR)));
+        termpaint_attr_set_patch(attrs.back(), true, setups.back().data(), "\033]8;;\033\\");
+    }
+
+    std::vector<termpaint_write_span> spans;
+    std::map<std::tuple<int,int>, Cell> expected;
+    for (int i = 0; i < 80 * 24; i++) {
+        const int attr_idx = (i * 7) % 40;
+        spans.push_back({ i % 80, i / 80, "x", 1, attrs[attr_idx].get(), 0, 79 });
+        expected[{i % 80, i / 80}] = singleWideChar("x").withPatch(true, setups[attr_idx], "\033]8;;\033\\");
+    }
+    termpaint_surface_write_spans(f.surface, spans.data(), spans.size());
+
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
+TEST_CASE("prepared text - same as write") {
+    Fixture f{20, 3};
+    usurface_ptr s2 = usurface_ptr::take_ownership(termpaint_terminal_new_surface(f.terminal, 20, 3));
+
+    const std::string big_cluster = "e\u0308\u0308\u0308\u0308";
+    const std::string str = GENERATE_COPY(as<std::string>(), "abc", "", "あえ", "a\u0308b", "\u0308x",
+                                          "x\x7f\u0308y", "a" + big_cluster + "b", "a\xffz", "ab\xe3\x81",
+                                          "あいうえおかきくけこ");
+    const int x = GENERATE(-3, -1, 0, 1, 15, 18, 19);
+    CAPTURE(str);
+    CAPTURE(x);
+
+    uattr_ptr attr;
+    attr.reset(termpaint_attr_new(TERMPAINT_COLOR_RED, TERMPAINT_COLOR_BLUE));
+    termpaint_attr_set_patch(attr, true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\");
+
+    for (termpaint_surface *surface: {f.surface, s2.get()}) {
+        termpaint_surface_clear(surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(surface, 0, 1, "あいうえおかきくけこ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    }
+
+    termpaint_surface_write_with_len_attr(f.surface, x, 1, str.data(), str.size(), attr);
+
+    uprepared_text_ptr text = uprepared_text_ptr::take_ownership(
+                termpaint_prepared_text_new(s2, str.data(), str.size()));
+    termpaint_surface_write_prepared_with_attr(s2, x, 1, text, attr, -1);
+
+    CHECK(termpaint_surface_same_contents(f.surface, s2));
+}
+
+
+TEST_CASE("prepared text - measurements and truncation") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    uprepared_text_ptr text = uprepared_text_ptr::take_ownership(
+                termpaint_prepared_text_new(f.surface, "aあe\u0308b", -1));
+    CHECK(termpaint_prepared_text_width(text) == 5);
+    CHECK(termpaint_prepared_text_clusters(text) == 4);
+
+    CHECK(termpaint_surface_write_prepared_with_colors(f.surface, 3, 3, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, -1) == 5);
+    // wide character does not fit, so only the first cluster is written
+    CHECK(termpaint_surface_write_prepared_with_colors(f.surface, 3, 4, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, 2) == 1);
+    CHECK(termpaint_surface_write_prepared_with_colors(f.surface, 3, 5, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, 4) == 4);
+    CHECK(termpaint_surface_write_prepared_with_colors(f.surface, 3, 6, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, 0) == 0);
+    // outside of the surface only measures
+    CHECK(termpaint_surface_write_prepared_with_colors(f.surface, 3, 30, text, TERMPAINT_DEFAULT_COLOR,
+                                                       TERMPAINT_DEFAULT_COLOR, 3) == 3);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, singleWideChar("a")},
+        {{ 4, 3 }, doubleWideChar("あ")},
+        {{ 6, 3 }, singleWideChar("e\u0308")},
+        {{ 7, 3 }, singleWideChar("b")},
+        {{ 3, 4 }, singleWideChar("a")},
+        {{ 3, 5 }, singleWideChar("a")},
+        {{ 4, 5 }, doubleWideChar("あ")},
+        {{ 6, 5 }, singleWideChar("e\u0308")},
+    });
+}
+
+
+TEST_CASE("write measured") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_write_result result;
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 3, "aあb", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, -1, nullptr, &result);
+    CHECK(result.end_x == 7);
+    CHECK(result.bytes == 5);
+    CHECK(result.clusters == 3);
+    CHECK_FALSE(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 4, "aあb", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 3, nullptr, &result);
+    CHECK(result.end_x == 6);
+    CHECK(result.bytes == 4);
+    CHECK(result.clusters == 2);
+    CHECK(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 5, "aあb", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 2, nullptr, &result);
+    CHECK(result.end_x == 4);
+    CHECK(result.bytes == 1);
+    CHECK(result.clusters == 1);
+    CHECK(result.truncated);
+
+    // combining characters are part of the last cluster
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 6, "abe\u0308c", 5, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, -1, nullptr, &result);
+    CHECK(result.end_x == 6);
+    CHECK(result.bytes == 5);
+    CHECK(result.clusters == 3);
+
+    // measuring continues outside of the surface
+    termpaint_surface_write_measured_with_colors(f.surface, 78, 7, "abcd", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, -1, nullptr, &result);
+    CHECK(result.end_x == 82);
+    CHECK(result.clusters == 4);
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 30, "abcd", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 3, nullptr, &result);
+    CHECK(result.end_x == 6);
+    CHECK(result.bytes == 3);
+    CHECK(result.truncated);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, singleWideChar("a")},
+        {{ 4, 3 }, doubleWideChar("あ")},
+        {{ 6, 3 }, singleWideChar("b")},
+        {{ 3, 4 }, singleWideChar("a")},
+        {{ 4, 4 }, doubleWideChar("あ")},
+        {{ 3, 5 }, singleWideChar("a")},
+        {{ 3, 6 }, singleWideChar("a")},
+        {{ 4, 6 }, singleWideChar("b")},
+        {{ 5, 6 }, singleWideChar("e\u0308")},
+        {{ 78, 7 }, singleWideChar("a")},
+        {{ 79, 7 }, singleWideChar("b")},
+    });
+}
+
+
+TEST_CASE("write measured - ellipsis") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_write_result result;
+
+    // fits without ellipsis
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 3, "abcd", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 4, "…", &result);
+    CHECK(result.end_x == 7);
+    CHECK(result.bytes == 4);
+    CHECK(result.clusters == 4);
+    CHECK_FALSE(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 4, "abcde", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 4, "…", &result);
+    CHECK(result.end_x == 7);
+    CHECK(result.bytes == 3);
+    CHECK(result.clusters == 4);
+    CHECK(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 5, "aあb", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 3, "…", &result);
+    CHECK(result.end_x == 5);
+    CHECK(result.bytes == 1);
+    CHECK(result.clusters == 2);
+    CHECK(result.truncated);
+
+    // ellipsis wider than the available space is not used
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 6, "abc", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 1, "あ", &result);
+    CHECK(result.end_x == 4);
+    CHECK(result.bytes == 1);
+    CHECK(result.clusters == 1);
+    CHECK(result.truncated);
+
+    // wide cluster crossing the start of the space reserved for the ellipsis
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 7, "a字", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 3, "…", &result);
+    CHECK(result.end_x == 6);
+    CHECK(result.bytes == 4);
+    CHECK(result.clusters == 2);
+    CHECK_FALSE(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 8, "a字b", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 4, "…", &result);
+    CHECK(result.end_x == 7);
+    CHECK(result.bytes == 5);
+    CHECK(result.clusters == 3);
+    CHECK_FALSE(result.truncated);
+
+    termpaint_surface_write_measured_with_colors(f.surface, 3, 9, "a字bc", -1, TERMPAINT_DEFAULT_COLOR,
+                                                 TERMPAINT_DEFAULT_COLOR, 4, "…", &result);
+    CHECK(result.end_x == 7);
+    CHECK(result.bytes == 4);
+    CHECK(result.clusters == 3);
+    CHECK(result.truncated);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, singleWideChar("a")},
+        {{ 4, 3 }, singleWideChar("b")},
+        {{ 5, 3 }, singleWideChar("c")},
+        {{ 6, 3 }, singleWideChar("d")},
+        {{ 3, 4 }, singleWideChar("a")},
+        {{ 4, 4 }, singleWideChar("b")},
+        {{ 5, 4 }, singleWideChar("c")},
+        {{ 6, 4 }, singleWideChar("…")},
+        {{ 3, 5 }, singleWideChar("a")},
+        {{ 4, 5 }, singleWideChar("…")},
+        {{ 3, 6 }, singleWideChar("a")},
+        {{ 3, 7 }, singleWideChar("a")},
+        {{ 4, 7 }, doubleWideChar("字")},
+        {{ 3, 8 }, singleWideChar("a")},
+        {{ 4, 8 }, doubleWideChar("字")},
+        {{ 6, 8 }, singleWideChar("b")},
+        {{ 3, 9 }, singleWideChar("a")},
+        {{ 4, 9 }, doubleWideChar("字")},
+        {{ 6, 9 }, singleWideChar("…")},
+    });
+}
+
 TEST_CASE("double width") {
     Fixture f{80, 24};
     termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
@@ -668,15 +937,15 @@ TEST_CASE("simple patch") {
 }
 
 
-TEST_CASE("too many patches") {
-    // white-box: There is an internal limit of 255 different patch settings at one time.
+TEST_CASE("many patches - all cells") {
+    // white-box: Patches used to be limited to 255 different settings at one time.
     Fixture f{80, 24};
     termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
 
     termpaint_attr* attr_url = termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
     using namespace std::literals;
     std::map<std::tuple<int,int>, Cell> expected;
-    for (int i = 0; i < 256; i++) {
+    for (int i = 0; i < 80 * 24; i++) {
         const std::string setup = "\033]8;;http://example.com\033\\"s + std::to_string(i);
         termpaint_attr_set_patch(attr_url, true, setup.data(), "\033]8;;\033\\");
         termpaint_surface_write_with_attr(f.surface, i % 80, i / 80, "x", attr_url);
@@ -684,14 +953,48 @@ TEST_CASE("too many patches") {
     }
     termpaint_attr_free(attr_url);
 
-    expected[{255 % 80, 255 / 80}] = singleWideChar("x");
-
     checkEmptyPlusSome(f.surface, expected);
 }
 
 
+TEST_CASE("many patches - reuse after clear") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_attr* attr_url = termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    using namespace std::literals;
+    for (int round = 0; round < 20; round++) {
+        std::map<std::tuple<int,int>, Cell> expected;
+        for (int i = 0; i < 400; i++) {
+            const std::string setup = "\033]8;;http://example.com\033\\"s + std::to_string(round * 1000 + i);
+            termpaint_attr_set_patch(attr_url, true, setup.data(), "\033]8;;\033\\");
+            termpaint_surface_write_with_attr(f.surface, i % 80, i / 80, "x", attr_url);
+            expected[{i % 80, i / 80}] = singleWideChar("x").withPatch(true, setup, "\033]8;;\033\\");
+        }
+        checkEmptyPlusSome(f.surface, expected);
+        termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    }
+    termpaint_attr_free(attr_url);
+}
+
+
+TEST_CASE("copy - patch is reset in target") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_attr* attr_url = termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_attr_set_patch(attr_url, true, "\033]8;;http://example.com\033\\", "\033]8;;\033\\");
+    termpaint_surface_write_with_attr(f.surface, 5, 5, "x", attr_url);
+    termpaint_attr_free(attr_url);
+
+    termpaint_surface_copy_rect(f.surface, 0, 0, 1, 1, f.surface, 5, 5,
+                                TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+
+    checkEmptyPlusSome(f.surface, {});
+}
+
+
 TEST_CASE("many patches - sequential") {
-    // white-box: There is an internal limit of 255 different patch settings at one time.
     Fixture f{80, 24};
     termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
 
@@ -857,6 +1160,45 @@ TEST_CASE("write starting with non spaceing combining mark") {
 }
 
 
+TEST_CASE("write long ascii text with non spacing combining mark and controls") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(f.surface, 5, 3, "0123456789abcdefghij\u0308klmnopq\trst\x7fuvwxyz",
+                                        TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    std::map<std::tuple<int,int>, Cell> expected;
+    const std::string text = "0123456789abcdefghij";
+    for (size_t i = 0; i < text.size() - 1; i++) {
+        expected[{5 + i, 3}] = singleWideChar(text.substr(i, 1));
+    }
+    expected[{24, 3}] = singleWideChar("j\u0308");
+    const std::string text2 = "klmnopq rst uvwxyz";
+    for (size_t i = 0; i < text2.size(); i++) {
+        expected[{25 + i, 3}] = singleWideChar(text2.substr(i, 1));
+    }
+    expected[{36, 3}] = singleWideChar(TERMPAINT_ERASED);
+
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
+TEST_CASE("write ascii with right clipping and non spacing combining mark") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors_clipped(f.surface, 5, 3, "abcdefghijklm\u0308", TERMPAINT_DEFAULT_COLOR,
+                                                TERMPAINT_DEFAULT_COLOR, 7, 17);
+
+    std::map<std::tuple<int,int>, Cell> expected;
+    const std::string text = "abcdefghijklm";
+    for (size_t i = 2; i < text.size() - 1; i++) {
+        expected[{5 + i, 3}] = singleWideChar(text.substr(i, 1));
+    }
+    expected[{17, 3}] = singleWideChar("m\u0308");
+
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
 TEST_CASE("double width with right clipping") {
     Fixture f{80, 24};
     termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
@@ -991,6 +1333,52 @@ TEST_CASE("gc of cluster with more than 8 bytes (with one to keep)") {
 }
 
 
+TEST_CASE("gc of cluster with more than 8 bytes (with flush, clear and copy)") {
+    // white-box: references from the last flushed state, cleared cells and copies need to keep storage alive
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    usurface_ptr offscreen = usurface_ptr::take_ownership(termpaint_terminal_new_surface(f.terminal, 80, 24));
+
+    const std::string keep_cluster = " \u0308\u0308\u0308\u0308";
+    termpaint_surface_write_with_colors(f.surface, 5, 5, keep_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    auto clusterFor = [] (int i) {
+        // U+0100 + i are all single width latin letters
+        const int cp = 0x100 + i;
+        return std::string({static_cast<char>(0xc0 | (cp >> 6)), static_cast<char>(0x80 | (cp & 0x3f))})
+                + std::string("\u0308\u0308\u0308\u0308");
+    };
+
+    std::string big_cluster;
+    for (int i = 0; i < 200; i++) {
+        big_cluster = clusterFor(i);
+        termpaint_surface_write_with_colors(f.surface, 3, 3, big_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(f.surface, 10 + i % 20, 7, big_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        if (i % 3 == 0) {
+            termpaint_terminal_flush(f.terminal, false);
+        }
+        if (i % 7 == 0) {
+            termpaint_surface_clear_rect(f.surface, 10, 7, 20, 1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        }
+        termpaint_surface_copy_rect(f.surface, 3, 3, 1, 1, offscreen, i % 80, i / 80,
+                                    TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    }
+    termpaint_surface_clear_rect(f.surface, 10, 7, 20, 1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_terminal_flush(f.terminal, false);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, singleWideChar(big_cluster)},
+        {{ 5, 5 }, singleWideChar(keep_cluster)},
+    });
+
+    std::map<std::tuple<int,int>, Cell> expected;
+    for (int i = 0; i < 200; i++) {
+        expected[{i % 80, i / 80}] = singleWideChar(clusterFor(i));
+    }
+    checkEmptyPlusSome(offscreen, expected);
+}
+
+
 // clear is implicitly tested all over the place
 
 
@@ -1544,6 +1932,188 @@ TEST_CASE("tint") {
 }
 
 
+TEST_CASE("tint rect") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_write_with_colors(f.surface, 3, 3, "あえ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(f.surface, 3, 4, "abc", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    int calls = 0;
+    termpaint_surface_tint_rect(f.surface, 4, 3, 2, 3, [] (void *user_data, unsigned *fg, unsigned *bg, unsigned *deco) {
+        (*static_cast<int*>(user_data))++;
+        *fg = TERMPAINT_COLOR_MAGENTA;
+        *bg = TERMPAINT_COLOR_GREEN;
+        *deco = TERMPAINT_COLOR_DARK_GREY;
+    }, &calls);
+
+    CHECK(calls == 5);
+
+    auto tinted = [] (Cell c) {
+        return c.withFg(TERMPAINT_COLOR_MAGENTA).withBg(TERMPAINT_COLOR_GREEN).withDeco(TERMPAINT_COLOR_DARK_GREY);
+    };
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, doubleWideChar("あ")},
+        {{ 5, 3 }, tinted(doubleWideChar("え"))},
+        {{ 3, 4 }, singleWideChar("a")},
+        {{ 4, 4 }, tinted(singleWideChar("b"))},
+        {{ 5, 4 }, tinted(singleWideChar("c"))},
+        {{ 4, 5 }, tinted(singleWideChar(TERMPAINT_ERASED))},
+        {{ 5, 5 }, tinted(singleWideChar(TERMPAINT_ERASED))},
+    });
+
+    calls = 0;
+    termpaint_surface_tint_rect(f.surface, -10, -10, 5, 5, [] (void *user_data, unsigned *fg, unsigned *bg, unsigned *deco) {
+        (void)fg; (void)bg; (void)deco;
+        (*static_cast<int*>(user_data))++;
+    }, &calls);
+    CHECK(calls == 0);
+}
+
+
+TEST_CASE("tint with transform") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_write_with_colors(f.surface, 3, 3, "ab", TERMPAINT_COLOR_RED, TERMPAINT_INDEXED_COLOR + 100);
+    termpaint_surface_write_with_colors(f.surface, 3, 4, "あ", TERMPAINT_RGB_COLOR(0x10, 0x80, 0xff),
+                                        TERMPAINT_RGB_COLOR(0, 0, 0));
+    termpaint_surface_set_deco_color(f.surface, 3, 4, TERMPAINT_COLOR_GREEN);
+    termpaint_surface_write_with_colors(f.surface, 0, 5, "x", 0x7000000, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_color_transform transform;
+    termpaint_color_transform_init(&transform);
+
+    SECTION("identity") {
+        termpaint_surface_tint_transform(f.surface, &transform);
+
+        checkEmptyPlusSome(f.surface, {
+            {{ 3, 3 }, singleWideChar("a").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_INDEXED_COLOR + 100)},
+            {{ 4, 3 }, singleWideChar("b").withFg(TERMPAINT_COLOR_RED).withBg(TERMPAINT_INDEXED_COLOR + 100)},
+            {{ 3, 4 }, doubleWideChar("あ").withFg(TERMPAINT_RGB_COLOR(0x10, 0x80, 0xff))
+                                          .withBg(TERMPAINT_RGB_COLOR(0, 0, 0))
+                                          .withDeco(TERMPAINT_COLOR_GREEN)},
+            {{ 0, 5 }, singleWideChar("x").withFg(0x7000000)},
+        });
+    }
+
+    SECTION("remap") {
+        transform.fg_default = TERMPAINT_COLOR_WHITE;
+        transform.bg_default = TERMPAINT_COLOR_BLACK;
+        transform.deco_default = TERMPAINT_COLOR_BLUE;
+        transform.named[1] = TERMPAINT_COLOR_DARK_GREY;
+        transform.named[2] = TERMPAINT_INDEXED_COLOR + 2;
+        transform.indexed[100] = TERMPAINT_RGB_COLOR(1, 2, 3);
+        transform.rgb_target = TERMPAINT_RGB_COLOR(0xff, 0xff, 0xff);
+        transform.rgb_alpha = 128;
+
+        termpaint_surface_tint_rect_transform(f.surface, 0, 3, 80, 3, &transform);
+
+        auto dflt = [](Cell c) {
+            return c.withFg(TERMPAINT_COLOR_WHITE).withBg(TERMPAINT_COLOR_BLACK).withDeco(TERMPAINT_COLOR_BLUE);
+        };
+
+        std::map<std::tuple<int,int>, Cell> expected = {
+            {{ 3, 3 }, singleWideChar("a").withFg(TERMPAINT_COLOR_DARK_GREY).withBg(TERMPAINT_RGB_COLOR(1, 2, 3))
+                                          .withDeco(TERMPAINT_COLOR_BLUE)},
+            {{ 4, 3 }, singleWideChar("b").withFg(TERMPAINT_COLOR_DARK_GREY).withBg(TERMPAINT_RGB_COLOR(1, 2, 3))
+                                          .withDeco(TERMPAINT_COLOR_BLUE)},
+            {{ 3, 4 }, doubleWideChar("あ").withFg(TERMPAINT_RGB_COLOR(0x87, 0xbf, 0xff))
+                                          .withBg(TERMPAINT_RGB_COLOR(0x7f, 0x7f, 0x7f))
+                                          .withDeco(TERMPAINT_INDEXED_COLOR + 2)},
+            {{ 0, 5 }, singleWideChar("x").withFg(0x7000000).withBg(TERMPAINT_COLOR_BLACK)
+                                          .withDeco(TERMPAINT_COLOR_BLUE)},
+        };
+        for (int y = 3; y < 6; y++) {
+            for (int x = 0; x < 80; x++) {
+                if (!expected.count({x, y}) && !(y == 4 && x == 4)) {
+                    expected[{x, y}] = dflt(singleWideChar(TERMPAINT_ERASED));
+                }
+            }
+        }
+
+        checkEmptyPlusSome(f.surface, expected);
+    }
+
+    SECTION("clusters crossing the rectangle") {
+        transform.rgb_target = TERMPAINT_RGB_COLOR(0xff, 0xff, 0xff);
+        transform.rgb_alpha = 256;
+
+        termpaint_surface_tint_rect_transform(f.surface, 4, 4, 1, 1, &transform);
+        CHECK(termpaint_surface_peek_fg_color(f.surface, 3, 4) == TERMPAINT_RGB_COLOR(0x10, 0x80, 0xff));
+        CHECK(termpaint_surface_peek_fg_color(f.surface, 4, 4) == TERMPAINT_RGB_COLOR(0x10, 0x80, 0xff));
+
+        termpaint_surface_tint_rect_transform(f.surface, 3, 4, 1, 1, &transform);
+        CHECK(termpaint_surface_peek_fg_color(f.surface, 3, 4) == TERMPAINT_RGB_COLOR(0xff, 0xff, 0xff));
+        CHECK(termpaint_surface_peek_fg_color(f.surface, 4, 4) == TERMPAINT_RGB_COLOR(0xff, 0xff, 0xff));
+        CHECK(termpaint_surface_peek_bg_color(f.surface, 4, 4) == TERMPAINT_RGB_COLOR(0xff, 0xff, 0xff));
+    }
+}
+
+
+TEST_CASE("set colors in rect") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_write_with_colors(f.surface, 3, 3, "あえ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(f.surface, 3, 4, "abc", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_set_fg_color_rect(f.surface, 4, 3, 2, 2, TERMPAINT_COLOR_GREEN);
+    termpaint_surface_set_bg_color_rect(f.surface, 3, 3, 1, 2, TERMPAINT_COLOR_BLUE);
+    termpaint_surface_set_deco_color_rect(f.surface, -1, 4, 5, 100, TERMPAINT_COLOR_RED);
+    termpaint_surface_set_fg_color_rect(f.surface, 78, 20, 0, 2, TERMPAINT_COLOR_GREEN);
+    termpaint_surface_set_fg_color_rect(f.surface, 80, 20, 2, 2, TERMPAINT_COLOR_GREEN);
+
+    std::map<std::tuple<int,int>, Cell> expected = {
+        {{ 3, 3 }, doubleWideChar("あ").withBg(TERMPAINT_COLOR_BLUE)},
+        {{ 5, 3 }, doubleWideChar("え").withFg(TERMPAINT_COLOR_GREEN)},
+        {{ 3, 4 }, singleWideChar("a").withBg(TERMPAINT_COLOR_BLUE).withDeco(TERMPAINT_COLOR_RED)},
+        {{ 4, 4 }, singleWideChar("b").withFg(TERMPAINT_COLOR_GREEN)},
+        {{ 5, 4 }, singleWideChar("c").withFg(TERMPAINT_COLOR_GREEN)},
+    };
+    for (int y = 4; y < 24; y++) {
+        for (int x = 0; x < 4; x++) {
+            auto it = expected.find({x, y});
+            if (it != expected.end()) {
+                if (x != 3 || y != 4) {
+                    it->second = it->second.withDeco(TERMPAINT_COLOR_RED);
+                }
+            } else {
+                expected[{x, y}] = singleWideChar(TERMPAINT_ERASED).withDeco(TERMPAINT_COLOR_RED);
+            }
+        }
+    }
+
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
+TEST_CASE("set style in rect") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    uattr_ptr attr;
+    attr.reset(termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR));
+    termpaint_attr_set_style(attr.get(), TERMPAINT_STYLE_ITALIC | TERMPAINT_STYLE_UNDERLINE_DBL);
+    termpaint_surface_write_with_attr(f.surface, 3, 3, "aあb", attr.get());
+    termpaint_surface_set_softwrap_marker(f.surface, 7, 3, true);
+
+    termpaint_surface_set_style_rect(f.surface, 4, 3, 4, 1, TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_UNDERLINE_CURLY);
+    termpaint_surface_unset_style_rect(f.surface, 3, 3, 1, 1, TERMPAINT_STYLE_ITALIC | TERMPAINT_STYLE_UNDERLINE);
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 3, 3 }, singleWideChar("a")},
+        {{ 4, 3 }, doubleWideChar("あ").withStyle(TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_ITALIC
+                                                  | TERMPAINT_STYLE_UNDERLINE_CURLY)},
+        {{ 6, 3 }, singleWideChar("b").withStyle(TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_ITALIC
+                                                 | TERMPAINT_STYLE_UNDERLINE_CURLY)},
+        {{ 7, 3 }, singleWideChar(TERMPAINT_ERASED).withStyle(TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_UNDERLINE_CURLY)
+                                                   .withSoftWrapMarker()},
+    });
+}
+
+
 TEST_CASE("char width") {
     Fixture f{80, 24};
     CHECK(termpaint_surface_char_width(f.surface, 'a') == 1);
@@ -1733,6 +2303,271 @@ TEST_CASE("off screen: compare") {
 
         CHECK_FALSE(termpaint_surface_same_contents(s1, s2));
     }
+
+    SECTION("same patch") {
+        uattr_ptr attr;
+        attr.reset(termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR));
+        termpaint_attr_set_patch(attr, true, "xxxx", "dfgh");
+        termpaint_surface_write_with_attr(s2, 0, 0, "x", attr);
+        termpaint_attr_set_patch(attr, true, "asdf", "dfgh");
+        termpaint_surface_write_with_attr(s1, 10, 3, "sample", attr);
+        termpaint_surface_write_with_attr(s2, 10, 3, "sample", attr);
+        termpaint_surface_write_with_colors(s2, 0, 0, " ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s1, 0, 0, " ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_same_contents(s1, s2));
+    }
+
+    SECTION("same long cluster") {
+        termpaint_surface_write_with_colors(s1, 10, 3, "a\u0308\u0308\u0308\u0308", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s2, 10, 3, "a\u0308\u0308\u0308\u0308", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_same_contents(s1, s2));
+
+        Fixture f2{80, 24};
+        usurface_ptr s3;
+        s3.reset(termpaint_terminal_new_surface(f2.terminal, 80, 24));
+        termpaint_surface_clear(s3, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s3, 10, 3, "a\u0308\u0308\u0308\u0308", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_same_contents(s1, s3));
+
+        termpaint_surface_write_with_colors(s3, 10, 3, "b\u0308\u0308\u0308\u0308", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK_FALSE(termpaint_surface_same_contents(s1, s3));
+    }
+
+    SECTION("short text after longer text") {
+        termpaint_surface_write_with_colors(s1, 10, 3, "\u00eb", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s1, 10, 3, "a", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s2, 10, 3, "a", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_same_contents(s1, s2));
+    }
+}
+
+
+TEST_CASE("export and import cells") {
+    Fixture f{80, 24};
+
+    usurface_ptr s1, s2;
+    s1.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+    s2.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+
+    termpaint_surface_clear(s1, TERMPAINT_COLOR_BLUE, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_clear(s2, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    uattr_ptr attr;
+    attr.reset(termpaint_attr_new(TERMPAINT_COLOR_RED, TERMPAINT_COLOR_GREEN));
+    termpaint_attr_set_deco(attr, TERMPAINT_COLOR_CYAN);
+    termpaint_attr_set_style(attr, TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_UNDERLINE_CURLY);
+    termpaint_surface_write_with_attr(s1, 3, 2, "Sampleあa\u0308\u0308\u0308\u0308x", attr);
+    termpaint_attr_set_patch(attr, false, "asdf", "dfgh");
+    termpaint_surface_write_with_attr(s1, 3, 3, "patched", attr);
+    termpaint_surface_set_softwrap_marker(s1, 79, 3, true);
+    termpaint_surface_set_softwrap_marker(s1, 0, 4, true);
+
+    std::vector<termpaint_cell_record> records(80 * 24);
+    termpaint_surface_export_cells(s1, 0, 0, 80, 24, records.data());
+
+    const termpaint_cell_record &wide = records[2 * 80 + 9];
+    CHECK(std::string(wide.text, wide.text_len) == "あ");
+    CHECK(wide.width == 2);
+    CHECK(records[2 * 80 + 10].width == 0);
+    CHECK(records[2 * 80 + 10].text_len == 0);
+    CHECK(wide.fg_color == TERMPAINT_COLOR_RED);
+    CHECK(wide.bg_color == TERMPAINT_COLOR_GREEN);
+    CHECK(wide.deco_color == TERMPAINT_COLOR_CYAN);
+    CHECK(wide.style == (TERMPAINT_STYLE_BOLD | TERMPAINT_STYLE_UNDERLINE_CURLY));
+    CHECK(wide.patch_setup == nullptr);
+
+    const termpaint_cell_record &patched = records[3 * 80 + 3];
+    CHECK(std::string(patched.patch_setup) == "asdf");
+    CHECK(std::string(patched.patch_cleanup) == "dfgh");
+    CHECK(patched.patch_optimize == false);
+    CHECK(records[3 * 80 + 79].softwrap_marker);
+
+    const termpaint_cell_record &empty = records[10 * 80 + 10];
+    CHECK(std::string(empty.text, empty.text_len) == TERMPAINT_ERASED);
+    CHECK(empty.fg_color == TERMPAINT_COLOR_BLUE);
+
+    termpaint_surface_import_cells(s2, 0, 0, 80, 24, records.data());
+    CHECK(termpaint_surface_same_contents(s1, s2));
+
+    // different terminal
+    Fixture f2{80, 24};
+    usurface_ptr s3;
+    s3.reset(termpaint_terminal_new_surface(f2.terminal, 80, 24));
+    termpaint_surface_import_cells(s3, 0, 0, 80, 24, records.data());
+    CHECK(termpaint_surface_same_contents(s1, s3));
+}
+
+
+TEST_CASE("export and import cells - partial clusters") {
+    Fixture f{80, 24};
+
+    usurface_ptr s1;
+    s1.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+    termpaint_surface_clear(s1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(s1, 0, 0, "あえ", TERMPAINT_COLOR_RED, TERMPAINT_DEFAULT_COLOR);
+
+    // export starts in the middle of あ and ends in the middle of え, import to a different place.
+    std::vector<termpaint_cell_record> records(2 * 1);
+    termpaint_surface_export_cells(s1, 1, 0, 2, 1, records.data());
+    CHECK(records[0].width == 0);
+    CHECK(records[1].width == 2);
+
+    termpaint_surface_import_cells(f.surface, 10, 3, 2, 1, records.data());
+    checkEmptyPlusSome(f.surface, {
+        {{ 10, 3 }, singleWideChar(" ").withFg(TERMPAINT_COLOR_RED)},
+        {{ 11, 3 }, singleWideChar(" ").withFg(TERMPAINT_COLOR_RED)},
+    });
+
+    // outside of the surface
+    records.resize(4);
+    termpaint_surface_export_cells(s1, 79, 23, 2, 2, records.data());
+    CHECK(records[1].width == 1);
+    CHECK(std::string(records[1].text, records[1].text_len) == TERMPAINT_ERASED);
+    CHECK(records[3].fg_color == 0);
+    termpaint_surface_import_cells(f.surface, -1, -1, 2, 2, records.data());
+}
+
+
+TEST_CASE("off screen: row hash") {
+    Fixture f{80, 24};
+
+    usurface_ptr s1, s2;
+    s1.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+    s2.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+
+    termpaint_surface_clear(s1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_clear(s2, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_write_with_colors(s1, 10, 3, "Sample あ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(s2, 10, 3, "Sample あ", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    CHECK(termpaint_surface_row_hash(s1, -1) == 0);
+    CHECK(termpaint_surface_row_hash(s1, 24) == 0);
+
+    for (int y = 0; y < 24; y++) {
+        CHECK(termpaint_surface_row_hash(s1, y) == termpaint_surface_row_hash(s2, y));
+    }
+    CHECK(termpaint_surface_row_hash(s1, 3) != termpaint_surface_row_hash(s1, 4));
+    CHECK(termpaint_surface_same_contents(s1, s2));
+
+    const unsigned before = termpaint_surface_row_hash(s1, 3);
+
+    SECTION("write") {
+        termpaint_surface_write_with_colors(s1, 10, 3, "s", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    }
+
+    SECTION("clear_rect") {
+        termpaint_surface_clear_rect(s1, 12, 2, 1, 3, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    }
+
+    SECTION("set fg color") {
+        termpaint_surface_set_fg_color(s1, 10, 3, TERMPAINT_COLOR_RED);
+    }
+
+    SECTION("set softwrap marker") {
+        termpaint_surface_set_softwrap_marker(s1, 79, 3, true);
+    }
+
+    SECTION("copy_rect") {
+        termpaint_surface_copy_rect(s2, 0, 0, 80, 1, s1, 0, 3, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    }
+
+    SECTION("tint") {
+        termpaint_surface_tint(s1, [](void *, unsigned *fg, unsigned *, unsigned *) {
+            *fg = TERMPAINT_COLOR_RED;
+        }, nullptr);
+    }
+
+    SECTION("patch") {
+        uattr_ptr attr;
+        attr.reset(termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR));
+        termpaint_attr_set_patch(attr, true, "asdf", "dfgh");
+        termpaint_surface_write_with_attr(s1, 10, 3, "S", attr);
+    }
+
+    CHECK(termpaint_surface_row_hash(s1, 3) != before);
+    CHECK_FALSE(termpaint_surface_same_contents(s1, s2));
+}
+
+
+TEST_CASE("off screen: diff") {
+    Fixture f{80, 24};
+
+    usurface_ptr s1, s2;
+    s1.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+    s2.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+
+    termpaint_surface_clear(s1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_clear(s2, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    termpaint_surface_write_with_colors(s1, 10, 3, "Sample あいう", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_colors(s2, 10, 3, "Sample あいう", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    using Span = std::tuple<int, int, int>;
+    std::vector<Span> spans;
+    auto collect = [] (void *user_data, int x, int y, int width) {
+        static_cast<std::vector<Span>*>(user_data)->emplace_back(x, y, width);
+    };
+
+    CHECK(termpaint_surface_diff(s1, s2, collect, &spans));
+    CHECK(spans.empty());
+
+    SECTION("spans") {
+        termpaint_surface_write_with_colors(s2, 10, 3, "s", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_write_with_colors(s2, 12, 3, "mp", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        termpaint_surface_set_bg_color(s2, 0, 5, TERMPAINT_COLOR_RED);
+        termpaint_surface_set_bg_color(s2, 79, 5, TERMPAINT_COLOR_RED);
+        termpaint_surface_set_softwrap_marker(s2, 20, 6, true);
+
+        CHECK(termpaint_surface_diff(s1, s2, collect, &spans));
+        CHECK(spans == std::vector<Span>{ Span{10, 3, 1}, Span{0, 5, 1}, Span{79, 5, 1}, Span{20, 6, 1} });
+    }
+
+    SECTION("clusters") {
+        // overwriting the right half of あ also changes the left half, い is replaced by two characters
+        termpaint_surface_write_with_colors(s2, 18, 3, "xyz", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_diff(s1, s2, collect, &spans));
+        CHECK(spans == std::vector<Span>{ Span{17, 3, 4} });
+    }
+
+    SECTION("wide characters shifted by one cell") {
+        termpaint_surface_write_with_colors(s2, 16, 3, "あいう", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_diff(s1, s2, collect, &spans));
+        CHECK(spans == std::vector<Span>{ Span{16, 3, 7} });
+    }
+
+    SECTION("patch") {
+        uattr_ptr attr;
+        attr.reset(termpaint_attr_new(TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR));
+        termpaint_attr_set_patch(attr, true, "asdf", "dfgh");
+        termpaint_surface_write_with_attr(s1, 30, 8, "SS", attr);
+        termpaint_attr_set_patch(attr, true, "asdf", "other");
+        termpaint_surface_write_with_attr(s2, 30, 8, "SS", attr);
+
+        CHECK(termpaint_surface_diff(s1, s2, collect, &spans));
+        CHECK(spans == std::vector<Span>{ Span{30, 8, 2} });
+    }
+
+    SECTION("duplicate") {
+        usurface_ptr s3 = usurface_ptr::take_ownership(termpaint_surface_duplicate(s1));
+        termpaint_surface_write_with_colors(s3, 0, 23, "abc", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+        CHECK(termpaint_surface_diff(s1, s3, collect, &spans));
+        CHECK(spans == std::vector<Span>{ Span{0, 23, 3} });
+    }
+
+    SECTION("different size") {
+        s2.reset(termpaint_terminal_new_surface(f.terminal, 80, 23));
+        CHECK_FALSE(termpaint_surface_diff(s1, s2, collect, &spans));
+        CHECK(spans.empty());
+    }
 }
 
 
@@ -2046,6 +2881,199 @@ TEST_CASE("copy - simple") {
 }
 
 
+TEST_CASE("copy - cluster with more than 8 bytes") {
+    // white-box: storage of long clusters is shared between surfaces of one terminal
+    Fixture f{80, 24};
+    Fixture f2{80, 24};
+
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_clear(f2.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    const std::string big_cluster = "e\u0308\u0308\u0308\u0308";
+
+    usurface_ptr s1 = usurface_ptr::take_ownership(termpaint_terminal_new_surface(f.terminal, 80, 24));
+    termpaint_surface_write_with_colors(s1, 10, 3, big_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    usurface_ptr s2 = usurface_ptr::take_ownership(termpaint_surface_duplicate(s1));
+
+    termpaint_surface_copy_rect(s1, 10, 3, 1, 1, f.surface, 23, 15, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    termpaint_surface_copy_rect(s1, 10, 3, 1, 1, f2.surface, 23, 15, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    s1.reset();
+
+    checkEmptyPlusSome(s2, {
+        {{ 10, 3 }, singleWideChar(big_cluster)},
+    });
+
+    checkEmptyPlusSome(f.surface, {
+        {{ 23, 15 }, singleWideChar(big_cluster)},
+    });
+
+    checkEmptyPlusSome(f2.surface, {
+        {{ 23, 15 }, singleWideChar(big_cluster)},
+    });
+}
+
+
+TEST_CASE("duplicate - copy on write") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    const std::string big_cluster = "e\u0308\u0308\u0308\u0308";
+    const char *setup = "\033]8;;http://example.com\033\\";
+    const char *cleanup = "\033]8;;\033\\";
+
+    uattr_ptr attr_url;
+    attr_url.reset(termpaint_attr_new(TERMPAINT_COLOR_RED, TERMPAINT_DEFAULT_COLOR));
+    termpaint_attr_set_patch(attr_url, true, setup, cleanup);
+
+    bool primary = GENERATE(false, true);
+    CAPTURE(primary);
+
+    usurface_ptr owned;
+    termpaint_surface *s1 = f.surface;
+    if (!primary) {
+        owned.reset(termpaint_terminal_new_surface(f.terminal, 80, 24));
+        s1 = owned;
+    }
+
+    termpaint_surface_write_with_colors(s1, 10, 3, big_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_write_with_attr(s1, 20, 4, "link", attr_url);
+    CHECK(termpaint_surface_row_hash(s1, 4) != 0);
+    if (primary) {
+        termpaint_terminal_flush(f.terminal, false);
+    }
+
+    usurface_ptr s2 = usurface_ptr::take_ownership(termpaint_surface_duplicate(s1));
+    CHECK(termpaint_surface_same_contents(s1, s2));
+    CHECK(termpaint_surface_row_hash(s1, 4) == termpaint_surface_row_hash(s2, 4));
+
+    // modifications of either surface do not change the other
+    termpaint_surface_write_with_colors(s1, 10, 3, "x", TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    termpaint_surface_set_fg_color_rect(s2, 20, 4, 2, 1, TERMPAINT_COLOR_GREEN);
+    CHECK_FALSE(termpaint_surface_same_contents(s1, s2));
+
+    checkEmptyPlusSome(s1, {
+        {{ 10, 3 }, singleWideChar("x")},
+        {{ 20, 4 }, singleWideChar("l").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+        {{ 21, 4 }, singleWideChar("i").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+        {{ 22, 4 }, singleWideChar("n").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+        {{ 23, 4 }, singleWideChar("k").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+    });
+
+    // s2 keeps its contents even after s1 is cleared or gone
+    termpaint_surface_clear(s1, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+    owned.reset();
+
+    checkEmptyPlusSome(s2, {
+        {{ 10, 3 }, singleWideChar(big_cluster)},
+        {{ 20, 4 }, singleWideChar("l").withFg(TERMPAINT_COLOR_GREEN).withPatch(true, setup, cleanup)},
+        {{ 21, 4 }, singleWideChar("i").withFg(TERMPAINT_COLOR_GREEN).withPatch(true, setup, cleanup)},
+        {{ 22, 4 }, singleWideChar("n").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+        {{ 23, 4 }, singleWideChar("k").withFg(TERMPAINT_COLOR_RED).withPatch(true, setup, cleanup)},
+    });
+
+    // duplicate of duplicate, the shared rows are released in any order
+    usurface_ptr s3 = usurface_ptr::take_ownership(termpaint_surface_duplicate(s2));
+    s2.reset();
+    termpaint_surface_write_with_attr(s3, 24, 4, "s", attr_url);
+    CHECK(termpaint_surface_peek_fg_color(s3, 24, 4) == TERMPAINT_COLOR_RED);
+    CHECK(termpaint_surface_peek_fg_color(s3, 21, 4) == TERMPAINT_COLOR_GREEN);
+}
+
+
+TEST_CASE("worker surfaces") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    const std::string big_cluster = "e\u0308\u0308\u0308\u0308";
+    const char *setup = "\033]8;;http://example.com\033\\";
+    const char *cleanup = "\033]8;;\033\\";
+
+    uattr_ptr attr_url;
+    attr_url.reset(termpaint_attr_new(TERMPAINT_COLOR_RED, TERMPAINT_DEFAULT_COLOR));
+    termpaint_attr_set_patch(attr_url, true, setup, cleanup);
+
+    usurface_ptr left = usurface_ptr::take_ownership(termpaint_terminal_new_worker_surface(f.terminal, 40, 24));
+    usurface_ptr right = usurface_ptr::take_ownership(termpaint_terminal_new_worker_surface(f.terminal, 40, 24));
+
+    auto paint = [&] (termpaint_surface *surface, const char *text) {
+        termpaint_surface_clear(surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        for (int i = 0; i < 1000; i++) {
+            int y = i % 24;
+            termpaint_surface_write_with_colors(surface, 2, y, big_cluster.data(), TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+            termpaint_surface_write_with_attr(surface, 4, y, text, attr_url);
+            termpaint_surface_write_with_colors(surface, 10, y, (big_cluster + std::to_string(i)).data(),
+                                                TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+        }
+    };
+
+    std::thread left_thread(paint, left.get(), "left");
+    std::thread right_thread(paint, right.get(), "right");
+    // The terminal and its other surfaces can be used at the same time.
+    paint(f.surface, "main");
+    left_thread.join();
+    right_thread.join();
+
+    termpaint_surface_copy_rect(left, 0, 0, 40, 24, f.surface, 0, 0, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    // duplicates share the storage of the worker surface
+    usurface_ptr right_dup = usurface_ptr::take_ownership(termpaint_surface_duplicate(right));
+    right.reset();
+    termpaint_surface_copy_rect(right_dup, 0, 0, 40, 24, f.surface, 40, 0, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+    left.reset();
+    right_dup.reset();
+
+    std::map<std::tuple<int,int>, Cell> expected;
+    for (int y = 0; y < 24; y++) {
+        for (int x = 0; x < 80; x += 40) {
+            const std::string text = x ? "right" : "left";
+            expected[{x + 2, y}] = singleWideChar(big_cluster);
+            for (size_t i = 0; i < text.size(); i++) {
+                expected[{x + 4 + int(i), y}] = singleWideChar(text.substr(i, 1)).withFg(TERMPAINT_COLOR_RED)
+                                                                                 .withPatch(true, setup, cleanup);
+            }
+            const std::string counter = std::to_string(1000 - 24 + ((y + 8) % 24));
+            expected[{x + 10, y}] = singleWideChar(big_cluster);
+            for (size_t i = 0; i < counter.size(); i++) {
+                expected[{x + 11 + int(i), y}] = singleWideChar(counter.substr(i, 1));
+            }
+        }
+    }
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
+TEST_CASE("worker surfaces - overlapping copy") {
+    Fixture f{80, 24};
+    termpaint_surface_clear(f.surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+
+    const std::string big_cluster = "e\u0308\u0308\u0308\u0308";
+
+    usurface_ptr worker = usurface_ptr::take_ownership(termpaint_terminal_new_worker_surface(f.terminal, 20, 2));
+
+    auto paint = [&] (termpaint_surface *surface) {
+        for (int i = 0; i < 1000; i++) {
+            termpaint_surface_clear(surface, TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+            termpaint_surface_write_with_colors(surface, 0, 0, ("\u3042" + big_cluster).data(),
+                                                TERMPAINT_DEFAULT_COLOR, TERMPAINT_DEFAULT_COLOR);
+            termpaint_surface_copy_rect(surface, 0, 0, 6, 1, surface, 2, 0, TERMPAINT_COPY_NO_TILE, TERMPAINT_COPY_NO_TILE);
+        }
+    };
+
+    std::thread worker_thread(paint, worker.get());
+    // overlapping copies on a worker surface must not touch the overflow text storage of the terminal
+    paint(f.surface);
+    worker_thread.join();
+
+    const std::map<std::tuple<int,int>, Cell> expected = {
+        { {0, 0}, doubleWideChar("\u3042") },
+        { {2, 0}, doubleWideChar("\u3042") },
+        { {4, 0}, singleWideChar(big_cluster) },
+    };
+    checkEmptyPlusSome(worker, expected);
+    checkEmptyPlusSome(f.surface, expected);
+}
+
+
 TEST_CASE("copy - width == 0") {
     Fixture f{80, 24};
 
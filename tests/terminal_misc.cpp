@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: BSL-1.0
 #include <random>
 #include <string>
+#include <vector>
 
 #ifndef BUNDLED_CATCH2
 #ifdef CATCH3
@@ -14,3 +15,128 @@
 
 #include <termpaint.h>
 
+#include "testhelper.h"
+
+namespace {
+    struct NullIntegration : public termpaint_integration {
+        NullIntegration() {
+            termpaint_integration_init(this,
+                                       [] (termpaint_integration*) {}, // free
+                                       [] (termpaint_integration*, const char*, int) {}, // write
+                                       [] (termpaint_integration*) {} // flush
+                                    );
+        }
+        ~NullIntegration() {
+            termpaint_integration_deinit(this);
+        }
+    };
+
+    std::string eventString(const termpaint_event *event) {
+        if (event->type == TERMPAINT_EV_CHAR) {
+            return std::string(event->c.string, event->c.length);
+        } else if (event->type == TERMPAINT_EV_KEY) {
+            return std::string(event->key.atom, event->key.length);
+        } else if (event->type == TERMPAINT_EV_PASTE) {
+            return std::string(event->paste.string, event->paste.length);
+        }
+        return std::string();
+    }
+}
+
+TEST_CASE("event queue") {
+    NullIntegration integration;
+    terminal_uptr term;
+    term.reset(termpaint_terminal_new(&integration));
+
+    CHECK(termpaint_terminal_next_event(term) == nullptr);
+
+    termpaint_terminal_set_event_queue_size(term, 4);
+
+    SECTION("basic") {
+        termpaint_terminal_add_input_data(term, "ab\033[A", 5);
+
+        termpaint_event *event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(event->type == TERMPAINT_EV_CHAR);
+        CHECK(eventString(event) == "a");
+
+        // strings stay valid while more input is added
+        termpaint_terminal_add_input_data(term, "x", 1);
+        CHECK(eventString(event) == "a");
+
+        event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(event->type == TERMPAINT_EV_CHAR);
+        CHECK(eventString(event) == "b");
+
+        event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(event->type == TERMPAINT_EV_KEY);
+        CHECK(event->key.atom == termpaint_input_arrow_up());
+
+        event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(eventString(event) == "x");
+
+        CHECK(termpaint_terminal_next_event(term) == nullptr);
+    }
+
+    SECTION("overflow") {
+        termpaint_terminal_add_input_data(term, "abcdef", 6);
+
+        std::vector<std::string> events;
+        while (termpaint_event *event = termpaint_terminal_next_event(term)) {
+            events.push_back(event->type == TERMPAINT_EV_OVERFLOW ? "overflow" : eventString(event));
+        }
+        CHECK(events == std::vector<std::string>{"a", "b", "c", "overflow"});
+
+        // queue accepts events again after the overflow event was read
+        termpaint_terminal_add_input_data(term, "g", 1);
+        termpaint_event *event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(eventString(event) == "g");
+    }
+
+    SECTION("paste") {
+        std::string content(100000, 'x');
+        std::string sequence = "\033[200~" + content + "\033[201~";
+        termpaint_terminal_add_input_data(term, sequence.data(), sequence.size());
+
+        std::string pasted;
+        while (termpaint_event *event = termpaint_terminal_next_event(term)) {
+            REQUIRE(event->type == TERMPAINT_EV_PASTE);
+            pasted += eventString(event);
+        }
+        CHECK(pasted == content);
+    }
+
+    SECTION("queue never empty") {
+        const std::vector<std::string> chars = {"a", "\u00e4", "\u20ac", "\U0001F600"};
+        termpaint_terminal_add_input_data(term, chars[0].data(), chars[0].size());
+        for (int i = 1; i < 10000; i++) {
+            const std::string &next = chars[i % chars.size()];
+            termpaint_terminal_add_input_data(term, next.data(), next.size());
+            termpaint_event *event = termpaint_terminal_next_event(term);
+            REQUIRE(event);
+            REQUIRE(eventString(event) == chars[(i - 1) % chars.size()]);
+        }
+        termpaint_event *event = termpaint_terminal_next_event(term);
+        REQUIRE(event);
+        CHECK(eventString(event) == chars[9999 % chars.size()]);
+        CHECK(termpaint_terminal_next_event(term) == nullptr);
+    }
+
+    SECTION("back to callback") {
+        termpaint_terminal_add_input_data(term, "a", 1);
+        termpaint_terminal_set_event_queue_size(term, 0);
+        CHECK(termpaint_terminal_next_event(term) == nullptr);
+
+        std::string received;
+        termpaint_terminal_set_event_cb(term, [] (void *ctx, termpaint_event *event) {
+            *static_cast<std::string*>(ctx) += eventString(event);
+        }, &received);
+        termpaint_terminal_add_input_data(term, "b", 1);
+        CHECK(received == "b");
+        CHECK(termpaint_terminal_next_event(term) == nullptr);
+    }
+}
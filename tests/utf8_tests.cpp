@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: BSL-1.0
 #include <string.h>
 
+#include <string>
+
 #ifndef BUNDLED_CATCH2
 #ifdef CATCH3
 #include "catch2/catch_all.hpp"
@@ -206,3 +208,50 @@ TEST_CASE( "utf8 brute force unicode", "[utf8]" ) {
 TEST_CASE( "utf8 brute force", "[.utf8slow]" ) {
     codepoint_test(1, 0x7fffffff);
 }
+
+TEST_CASE("ascii prefix") {
+    std::string str = "0123456789abcdefghijklmnopqrstuvwxyz0123456789";
+    for (size_t len = 0; len <= str.size(); len++) {
+        INFO(len);
+        CHECK(termpaintp_utf8_ascii_prefix(u8p(str.data()), len) == (int)len);
+    }
+    for (size_t pos = 0; pos < str.size(); pos++) {
+        INFO(pos);
+        std::string modified = str;
+        modified[pos] = '\xc3';
+        CHECK(termpaintp_utf8_ascii_prefix(u8p(modified.data()), modified.size()) == (int)pos);
+    }
+}
+
+TEST_CASE("printable ascii prefix") {
+    std::string str = "0123456789abcdefghijklmnopqrstuvwxyz ~!0123456789";
+    for (size_t len = 0; len <= str.size(); len++) {
+        INFO(len);
+        CHECK(termpaintp_utf8_printable_ascii_prefix(u8p(str.data()), len) == (int)len);
+    }
+    for (char ch: {'\x00', '\x1f', '\x7f', '\x80', '\xc3', '\xff'}) {
+        for (size_t pos = 0; pos < str.size(); pos++) {
+            INFO(pos);
+            INFO((int)ch);
+            std::string modified = str;
+            modified[pos] = ch;
+            CHECK(termpaintp_utf8_printable_ascii_prefix(u8p(modified.data()), modified.size()) == (int)pos);
+        }
+    }
+}
+
+TEST_CASE("valid prefix") {
+    const std::string valid = "abcäあdefghijklmnopqrstuvwxyz\U0001F600xyz";
+
+    CHECK(termpaintp_utf8_valid_prefix(u8p(valid.data()), valid.size()) == (int)valid.size());
+    CHECK(termpaintp_utf8_valid_prefix(u8p(valid.data()), 0) == 0);
+    // incomplete sequence at the end is not part of the prefix
+    CHECK(termpaintp_utf8_valid_prefix(u8p(valid.data()), 4) == 3);
+    CHECK(termpaintp_utf8_valid_prefix(u8p(valid.data()), 7) == 5);
+
+    for (const char *invalid: {"\x80", "\xc0\x80", "\xe0\x80\x80", "\xed\xa0\x80", "\xf0\x80\x80\x80", "\xfe", "\xc3x"}) {
+        INFO(invalid);
+        std::string str = valid + invalid + valid;
+        CHECK(termpaintp_utf8_valid_prefix(u8p(str.data()), str.size()) == (int)valid.size());
+    }
+}
@@ -84,7 +84,6 @@ import_allowlist_x = [
 expected_leaked_private = [
   # used in development and automated testing, these are not supposed to used by any applications
     'termpaintp_test',              # entry point for testing
-    'termpaintp_input_selfcheck',   # self check
     'termpaintp_input_dump_table',  # dumps input mapping table for fuzztesting dataset.
   # internal cross file imports
     'termpaintp_rescue_embedded',   # needed by termpaintx.c